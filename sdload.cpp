@@ -0,0 +1,232 @@
+/**
+ * @author	Steven Clark
+ * @File	sdload.cpp
+ * @brief	Load generator for the spamdetector socket service (spamdetector -S).
+ * Sends generated <DOC> messages over a number of connections, either as fast as the
+ * answers come back (closed loop) or at a fixed arrival rate (open loop), and reports
+ * throughput and latency percentiles.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using std::cout;
+using std::cerr;
+using std::vector;
+using std::endl;
+using std::string;
+using std::stringstream;
+
+/// @brief Seconds since the epoch with microsecond resolution
+double now(){
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/// @brief Words making up the generated message bodies
+const char* filler[] = {"meeting", "agenda", "report", "the", "of", "and", "attached", "please", "review",
+	"thanks", "schedule", "project", "update", "budget", "quarter", "team", "notes", "draft", "call", "monday"};
+
+/// @brief Keywords making a generated message spam
+const char* bait[] = {"winners", "free access", "free vacation", "winnings", "free trials"};
+
+/// @brief Builds a message record
+/// @param id Number of the message, its DOCID is msg<id>
+/// @param bytes Approximate length of the body
+/// @param spam Put a spam keyword in the body
+string makeMessage(long id, long bytes, bool spam){
+	stringstream ss;
+	ss << "<DOC>\n<DOCID> msg" << id << " </DOCID>\nSubject: load " << id << "\n\n";
+	long body = 0, baitAt = spam ? rand() % (bytes + 1) : -1;
+	while(body < bytes){
+		const char* w = filler[rand() % (sizeof(filler) / sizeof(*filler))];
+		if(baitAt >= 0 and body >= baitAt){
+			w = bait[rand() % (sizeof(bait) / sizeof(*bait))];
+			baitAt = -1;
+		}
+		ss << w << ' ';
+		body += strlen(w) + 1;
+	}
+	if(baitAt >= 0)
+		ss << bait[rand() % (sizeof(bait) / sizeof(*bait))] << ' ';
+	ss << "\n</DOC>\n";
+	return ss.str();
+}
+
+/// @brief One connection to the service
+struct connection{
+	int fd;
+	string out;					///< @brief Bytes not sent yet
+	string in;					///< @brief Answer bytes not parsed yet
+	vector<double> intended;	///< @brief When each message of the connection was due to be sent, by number - 1
+	long answered;				///< @brief Answers received
+	bool greeted;				///< @brief The "credit" line has been read
+};
+
+/// @brief Prints the command line options to standard error
+/// @param prog The name the program was invoked with
+void usage(const char* prog){
+	cerr << "Usage: " << prog << " -S path [-c connections] [-n messages] [-r rate] [-o outstanding] [-b bytes] [-p percent]" << endl
+		<< "  -S path   Unix socket of the service (spamdetector -S path)" << endl
+		<< "  -c N      connections to open (default 4)" << endl
+		<< "  -n N      messages to send in all (default 10000)" << endl
+		<< "  -r N      open loop: send N messages per second in all, 0 for closed loop (default 0)" << endl
+		<< "  -o N      closed loop: messages kept unanswered per connection (default 1)" << endl
+		<< "  -b N      mean body length in bytes, bodies range from 0 to twice this (default 2000)" << endl
+		<< "  -p N      percent of the messages holding a spam keyword (default 20)" << endl;
+}
+
+/// @brief Drives the service and reports throughput and latency
+/// @return Unix exit code, 0 for success
+int main(int argc, char** argv){
+	const char* path = NULL;
+	int conns = 4;
+	long total = 10000;
+	double rate = 0;
+	long window = 1;
+	long bytes = 2000;
+	int spamPercent = 20;
+	int opt;
+	while((opt = getopt(argc, argv, "S:c:n:r:o:b:p:")) != -1){
+		switch(opt){
+		case 'S': path = optarg; break;
+		case 'c': conns = atoi(optarg); break;
+		case 'n': total = atol(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'o': window = atol(optarg); break;
+		case 'b': bytes = atol(optarg); break;
+		case 'p': spamPercent = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if(path == NULL or conns < 1 or total < 1 or window < 1 or bytes < 0){
+		usage(argv[0]);
+		return -1;
+	}
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	vector<connection> c(conns);
+	for(int i = 0; i < conns; ++i){
+		c[i].fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(c[i].fd < 0 or connect(c[i].fd, (sockaddr*)&addr, sizeof(addr)) < 0){
+			cerr << "Error: can not connect to " << path << ": " << strerror(errno) << endl;
+			return -1;
+		}
+		fcntl(c[i].fd, F_SETFL, O_NONBLOCK);
+		c[i].answered = 0;
+		c[i].greeted = false;
+	}
+
+	//messages are dealt to the connections in turn
+	vector<double> latency;
+	long sent = 0, received = 0, busy = 0, spam = 0;
+	double began = now();
+	vector<pollfd> fds(conns);
+	while(received < total){
+		double t = now();
+
+		//queue the messages due: on schedule in open loop, latency counting from when each was due
+		//even if the service held the sender up, or whenever a connection has room in closed loop
+		while(sent < total){
+			connection &k = c[sent % conns];
+			double due;
+			if(rate > 0){
+				due = began + sent / rate;
+				if(due > t)
+					break;
+			}else{
+				if((long)k.intended.size() - k.answered >= window)
+					break;
+				due = t;
+			}
+			k.intended.push_back(due);
+			k.out += makeMessage(sent + 1, bytes > 0 ? rand() % (2 * bytes + 1) : 0, rand() % 100 < spamPercent);
+			++sent;
+		}
+
+		for(int i = 0; i < conns; ++i){
+			fds[i].fd = c[i].fd;
+			fds[i].events = POLLIN | (c[i].out.empty() ? 0 : POLLOUT);
+			fds[i].revents = 0;
+		}
+		int wait = -1;
+		if(rate > 0 and sent < total)
+			wait = std::max(0, (int)((began + sent / rate - t) * 1000));
+		if(poll(&fds[0], conns, wait) < 0 and errno != EINTR){
+			cerr << "Error: poll: " << strerror(errno) << endl;
+			return -1;
+		}
+
+		for(int i = 0; i < conns; ++i){
+			connection &k = c[i];
+			if(fds[i].revents & POLLOUT){
+				ssize_t n = send(k.fd, k.out.data(), k.out.size(), MSG_NOSIGNAL);
+				if(n > 0)
+					k.out.erase(0, n);
+			}
+			if(fds[i].revents & (POLLIN | POLLHUP)){
+				char buf[65536];
+				ssize_t n = read(k.fd, buf, sizeof(buf));
+				if(n == 0){
+					cerr << "Error: the service closed a connection" << endl;
+					return -1;
+				}
+				if(n > 0)
+					k.in.append(buf, n);
+				double got = now();
+				size_t eol;
+				while((eol = k.in.find('\n')) != string::npos){
+					string line = k.in.substr(0, eol);
+					k.in.erase(0, eol + 1);
+					if(!k.greeted){
+						k.greeted = true;
+						continue;
+					}
+					long number = atol(line.c_str());
+					if(number < 1 or number > (long)k.intended.size())
+						continue;
+					latency.push_back(got - k.intended[number - 1]);
+					if(line.find("busy") != string::npos)
+						++busy;
+					else if(line.find("spam") != string::npos)
+						++spam;
+					++k.answered;
+					++received;
+				}
+			}
+		}
+	}
+	double elapsed = now() - began;
+	for(int i = 0; i < conns; ++i)
+		close(c[i].fd);
+
+	std::sort(latency.begin(), latency.end());
+	cout << received << " messages in " << elapsed << " s: " << received / elapsed << " messages/s, "
+		<< spam << " spam, " << busy << " busy" << endl;
+	const double points[] = {50, 90, 99, 99.9, 100};
+	cout << "latency (ms)";
+	for(size_t i = 0; i < sizeof(points) / sizeof(*points); ++i){
+		size_t at = std::min(latency.size() - 1, (size_t)(points[i] / 100 * latency.size()));
+		cout << "  p" << points[i] << ' ' << latency[at] * 1e3;
+	}
+	cout << endl;
+	return 0;
+}
@@ -12,8 +12,36 @@
 #include <string>
 #include <sstream>
 #include <list>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <climits>
+#include <sys/time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) and defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <linux/aio_abi.h>
+#include <sys/wait.h>
+#include <stdint.h>
 
 using std::istream;
+using std::ostream;
 using std::cout;
 using std::cerr;
 using std::vector;
@@ -22,6 +50,7 @@ using std::cin;
 using std::string;
 using std::stringstream;
 using std::list;
+using std::map;
 
 //Functions used to identify input symbols (individually or grouped) for transitions
 //First parameter is an input character to check, second an integer to compare it against
@@ -30,7 +59,8 @@ typedef bool(* charComparator)(char, int);
 
 //Command functions that effect overall program state
 //These are used to queue spam message IDs for later printing
-typedef void(* charConsumer)(char);
+//First parameter is the input character, second an integer argument given with the transition
+typedef void(* charConsumer)(char, int);
 
 /// @brief Returns true for all unhandled characters in the alphabet
 /// @return true, in all cases
@@ -54,110 +84,3524 @@ bool whitespace(char c, int){
 	return c == ' ' or c == '\t' or c == '\r' or c == '\n';
 }
 
-/// @brief Is this character one of the delimiters for a spam keyword
+/// @brief Normalization class of every byte value, used to match obfuscated spelling of keywords
+/// @note Identity by default, equivalence sets given on the command line merge classes before the automaton is compiled
+unsigned char foldClass[256];
+
+/// @brief Merges a set of characters into one normalization class
+/// @param chars String of characters to treat as the same keyword letter, e.g. "il1"
+void addEquivalence(const char* chars){
+	unsigned char into = foldClass[(unsigned char)chars[0]];
+	for(; *chars; ++chars){
+		unsigned char from = foldClass[(unsigned char)*chars];
+		for(int i=0; i<256; ++i)
+			if(foldClass[i] == from) foldClass[i] = into;
+	}
+}
+
+/// @brief Matches an input character against a keyword letter, allowing normalization equivalents
+/// @param c An input character to check.
+/// @param against The keyword letter to compare c to.
+/// @return true if c and against are in the same normalization class
+bool keyChar(char c, int against){ return foldClass[(unsigned char)c] == foldClass[(unsigned char)against]; }
+
+/// @brief Flag bits describing the word boundary role of an input byte
+enum boundaryFlag{
+	LEADING_DELIMITER = 1,	///< @brief Byte may precede a spam keyword
+	TRAILING_DELIMITER = 2	///< @brief Byte may follow a spam keyword
+};
+
+/// @brief Word boundary flags for every byte value, defaults to space and double quote for both
+/// @note Only consulted while the automaton is compiled, so the size of the sets costs nothing per input byte
+unsigned char boundaryClass[256];
+
+/// @brief Replaces the set of bytes carrying a word boundary flag
+/// @param chars String of the bytes that should carry the flag
+/// @param flag The boundaryFlag to assign
+void setDelimiters(const char* chars, boundaryFlag flag){
+	for(int i=0; i<256; ++i) boundaryClass[i] &= ~flag;
+	for(; *chars; ++chars) boundaryClass[(unsigned char)*chars] |= flag;
+}
+
+/// @brief Is this character one of the leading delimiters for a spam keyword
+/// @param c An input symbol to check.
+/// @return true if c may precede a keyword, space or double quote by default
+bool delimiters(char c, int){ return boundaryClass[(unsigned char)c] & LEADING_DELIMITER; }
+
+/// @brief Does this character carry all of the given word boundary flags
+/// @param c An input symbol to check.
+/// @param flags boundaryFlag bits OR'ed together
+/// @return true if c has every flag in flags
+bool boundaryIs(char c, int flags){ return (boundaryClass[(unsigned char)c] & flags) == flags; }
+
+/// @brief Is this character one of the trailing delimiters for a spam keyword
 /// @param c An input symbol to check.
-/// @return true if c is space or double quote
-bool delimiters(char c, int){ return c==' ' or c=='\"'; }
+/// @return true if c may end a keyword, space or double quote by default
+bool trailingDelimiters(char c, int){ return boundaryClass[(unsigned char)c] & TRAILING_DELIMITER; }
+
+
+/// @brief Holds a finite automata state and all it's outgoing transitions.
+class DFAstate{
+protected:
+	/// @brief Holds the definition of an outgoing transition function
+	class transitionRecord{
+	public:
+		charComparator onSymbols;///< @brief Input symbol identification trigger function.
+		DFAstate* to;			///< @brief Destination state
+		charConsumer doing;		///< @brief Optional edge action.
+		int comparedTo;			///< @brief optional value to compare input to (needed to identify single character with one function)
+		int actionArg;			///< @brief optional value passed to the edge action
+
+		/// @brief Builds a new transition function from it's defining parameters
+		transitionRecord(charComparator which, DFAstate &where, charConsumer does = NULL, int what = -129, int arg = 0){
+			onSymbols = which; to = &where; doing = does; comparedTo = what; actionArg = arg;
+		}
+	};
+
+	/// @brief The in order list of all the state's outgoing transitions
+	vector<transitionRecord> transitions;
+public:
+	/// @brief A user-readable ID for this state.
+	string name;
+
+	/// @builds a name for this function by concatenating an integer onto a string, for naming sequences of states.
+	/// @param newname String literal of the prefix of the name
+	///	@param suffix An integer suffix for the name
+	void iteratedname(const char* newname, int suffix){
+		stringstream ss;
+		ss << newname << suffix;
+		name = ss.str();
+	}
+
+	/// @brief Adds a new outgoing transition to this state.
+	/// @note Previously defined transitions will take precedence and catch whichever characters they identify, removing those from subsequent transitions
+	/// @param which Pointer to a function that returns true if an input symbol triggers this transition
+	/// @param where Reference to the detination state of this transition.
+	/// @param does An optional pointer to an action function that is executed on this transition.  Null by default
+	/// @param what An optional value to compare input characters against if the trigger function requires it.  Invalid for that use by default.
+	/// @param arg An optional value passed to the action function.  Zero by default
+	void addTransition(charComparator which, DFAstate &where, charConsumer does = NULL, int what = -129, int arg = 0){
+		transitions.push_back(*(new transitionRecord(which, where, does, what, arg)));
+	}
+
+	/// @brief Find the outgoing transition from this state for an input symbol without taking it.
+	/// @param c An input symbol to look up.
+	/// @param does Set to the action of the matching transition, NULL if it has none.
+	/// @param arg Set to the argument for the action.
+	/// @return A pointer to the next state in the automaton, NULL if unhandled
+	/// @note While the structure of the automaton is nondeterministic in theory, this function interprets that structure in a strictly deterministic fashion.
+	DFAstate *peekTransition(char c, charConsumer &does, int &arg){
+		does = NULL;
+		arg = 0;
+		for(vector<transitionRecord>::iterator i = transitions.begin(); i != transitions.end(); i++){
+			if(i->onSymbols(c,i->comparedTo)){
+				does = i->doing;
+				arg = i->actionArg;
+				return i->to;
+			}
+		}
+		return NULL;
+	}
+
+	/// @brief Take the outgoing transition from this state given an input symbol.
+	/// @param c An input symbol to transition with.
+	/// @return A pointer to the next state in the automaton, NULL if unhandled
+	DFAstate *transitionWithChar(char c){
+		charConsumer does;
+		int arg;
+		DFAstate *next = peekTransition(c, does, arg);
+		if(does != NULL)
+			does(c, arg);
+		return next;
+	}
+};
+
+/// @brief A DFAstate graph flattened into a transition table indexed by state and byte class.
+/// Bytes which take the same transition out of every state share a byte class (column),
+/// so the scanning loop does one map lookup and one table lookup per input byte
+/// no matter how many comparators each state was wired with.
+///
+/// The table is dense, a full row per state, unless compacted. The hybrid layout keeps each
+/// distinct transition once and rows of 32 bit references to them. A state whose row differs
+/// from its most common transition in at most 16 classes, as most keyword states do (they go
+/// on with one letter and otherwise fall back to delimited or not-delimited), keeps only those
+/// classes, found with one SSE2 compare, and the common transition; the others keep a dense row.
+/// The displaced layout overlays the rows in one slot array, each row at its own base offset
+/// and each slot checked against the state owning it (row displacement, as in double array
+/// tries). A row given a default state keeps only the classes where it differs from that
+/// state's row, which serves the others (comb vector default transitions), so a keyword state
+/// falling back to delimited or not-delimited keeps one slot per letter it goes on with.
+class DFAtable{
+public:
+	/// @brief How the transitions are stored
+	enum layoutKind{
+		DENSE,		///< @brief table, a row of entries per state
+		HYBRID,		///< @brief pool, with a dense or sparse row of references per state
+		DISPLACED	///< @brief pool, with the rows overlaid in slots
+	};
+	/// @brief One compiled outgoing transition
+	struct entry{
+		int to;				///< @brief Index of the destination state, -1 if the symbol is unhandled
+		charConsumer doing;	///< @brief Optional edge action.
+		int arg;			///< @brief Argument passed to the edge action
+	};
+
+	unsigned char byteClass[256];	///< @brief Column of the table used for each input byte
+	int numClasses;					///< @brief Number of distinct byte classes (table columns)
+	vector<DFAstate*> states;		///< @brief All states reachable from the start state, start state first
+	map<DFAstate*, int> index;		///< @brief Row of each state in the table
+	vector<entry> table;			///< @brief Row per state, column per byte class
+	vector<int> plainRow;			///< @brief Start of the destination's row for each transition without an edge action, -1 for the others
+	layoutKind layout;
+
+	/// @brief Where a state's transitions are in the hybrid layout
+	struct rowRef{
+		int count;			///< @brief Number of labels of a sparse row, -1 for a dense row
+		int labels;			///< @brief Start of a sparse row's 16 class labels in labels
+		int targets;		///< @brief Start of its references in targets: one per class for a dense row, one per label for a sparse one
+		unsigned fallback;	///< @brief Transition of the classes a sparse row does not list
+	};
+	vector<entry> pool;				///< @brief Each distinct transition once, hybrid layout
+	vector<rowRef> rows;			///< @brief Row of each state, hybrid layout
+	vector<unsigned char> labels;	///< @brief Classes listed by the sparse rows, 16 per row
+	vector<unsigned> targets;		///< @brief References into pool
+
+	/// @brief Where a state's row is in the displaced layout
+	struct displacedRow{
+		int base;			///< @brief Slot of byte class 0
+		int defaultRow;		///< @brief State whose row serves the classes this one does not own, -1 for none
+		unsigned fallback;	///< @brief Transition of the classes not owned, without a default state
+	};
+	/// @brief One transition of the displaced layout
+	struct slot{
+		int check;			///< @brief State owning the slot, -1 for none
+		unsigned next;		///< @brief Its transition in pool
+	};
+	vector<displacedRow> bases;		///< @brief Row of each state, displaced layout
+	vector<slot> slots;				///< @brief The rows overlaid, displaced layout
+
+	DFAtable(){ layout = DENSE; }
+
+	/// @brief Flattens every state reachable from start into the table
+	/// @param start The start state of the automaton, given index 0
+	/// @param entries States not reached by any transition, which the scan loop jumps to
+	void compile(DFAstate &start, const vector<DFAstate*> &entries = vector<DFAstate*>()){
+		vector<entry> raw;	//row per state, column per byte value
+		index.clear();
+		states.clear();
+		states.push_back(&start);
+		index[&start] = 0;
+		for(size_t i = 0; i < entries.size(); ++i){
+			if(index.find(entries[i]) == index.end()){
+				index[entries[i]] = states.size();
+				states.push_back(entries[i]);
+			}
+		}
+		for(size_t s = 0; s < states.size(); ++s){
+			for(int b = 0; b < 256; ++b){
+				entry e;
+				DFAstate *next = states[s]->peekTransition((char)b, e.doing, e.arg);
+				e.to = -1;
+				if(next != NULL){
+					if(index.find(next) == index.end()){
+						index[next] = states.size();
+						states.push_back(next);
+					}
+					e.to = index[next];
+				}
+				raw.push_back(e);
+			}
+		}
+
+		//group bytes whose columns are identical in every row
+		vector<int> representative;
+		for(int b = 0; b < 256; ++b){
+			int c;
+			for(c = 0; c < (int)representative.size(); ++c){
+				int r = representative[c];
+				size_t s;
+				for(s = 0; s < states.size(); ++s){
+					const entry &x = raw[s*256+b], &y = raw[s*256+r];
+					if(x.to != y.to or x.doing != y.doing or x.arg != y.arg)
+						break;
+				}
+				if(s == states.size())
+					break;
+			}
+			if(c == (int)representative.size())
+				representative.push_back(b);
+			byteClass[b] = c;
+		}
+		numClasses = representative.size();
+
+		table.resize(states.size() * numClasses);
+		for(size_t s = 0; s < states.size(); ++s)
+			for(int c = 0; c < numClasses; ++c)
+				table[s*numClasses + c] = raw[s*256 + representative[c]];
+
+		plainRow.resize(table.size());
+		for(size_t i = 0; i < table.size(); ++i)
+			plainRow[i] = table[i].doing == NULL and table[i].to >= 0 ? table[i].to * numClasses : -1;
+	}
+
+	/// @brief Stores the table in the hybrid or displaced layout, releasing the dense one
+	/// @param defaults States whose rows the other rows may fall back to, displaced layout
+	void compact(layoutKind kind, const vector<DFAstate*> &defaults = vector<DFAstate*>()){
+		map<std::pair<std::pair<int, long>, int>, unsigned> seen;	//pool index of each distinct transition
+		vector<unsigned> ref(table.size());
+		for(size_t i = 0; i < table.size(); ++i){
+			std::pair<std::pair<int, long>, int> key(std::make_pair(table[i].to, (long)table[i].doing), table[i].arg);
+			map<std::pair<std::pair<int, long>, int>, unsigned>::iterator f = seen.find(key);
+			if(f == seen.end()){
+				f = seen.insert(std::make_pair(key, (unsigned)pool.size())).first;
+				pool.push_back(table[i]);
+			}
+			ref[i] = f->second;
+		}
+
+		//the most common transition of each row, and the classes going elsewhere
+		vector<unsigned> common(states.size());
+		vector<vector<unsigned char> > others(states.size());
+		for(size_t s = 0; s < states.size(); ++s){
+			const unsigned* row = &ref[s*numClasses];
+			map<unsigned, int> uses;
+			common[s] = row[0];
+			for(int c = 0; c < numClasses; ++c)
+				if(++uses[row[c]] > uses[common[s]])
+					common[s] = row[c];
+			for(int c = 0; c < numClasses; ++c)
+				if(row[c] != common[s])
+					others[s].push_back(c);
+		}
+
+		if(kind == HYBRID){
+			rows.resize(states.size());
+			for(size_t s = 0; s < states.size(); ++s){
+				const unsigned* row = &ref[s*numClasses];
+				rowRef &r = rows[s];
+				r.targets = targets.size();
+				r.fallback = common[s];
+				if(others[s].size() > 16){
+					r.count = -1;
+					r.labels = 0;
+					targets.insert(targets.end(), row, row + numClasses);
+					continue;
+				}
+				r.count = others[s].size();
+				r.labels = labels.size();
+				labels.resize(labels.size() + 16, 0);
+				for(int i = 0; i < r.count; ++i){
+					labels[r.labels + i] = others[s][i];
+					targets.push_back(row[others[s][i]]);
+				}
+			}
+		}else{
+			//each row keeps the classes going elsewhere than its most common transition, or than the
+			//row of the default state it differs from least; default states keep their own
+			bases.resize(states.size());
+			vector<int> defaultRows;
+			for(size_t d = 0; d < defaults.size(); ++d)
+				if(index.find(defaults[d]) != index.end())
+					defaultRows.push_back(index[defaults[d]]);
+			for(size_t s = 0; s < states.size(); ++s){
+				bases[s].defaultRow = -1;
+				bases[s].fallback = common[s];
+				if(std::find(defaultRows.begin(), defaultRows.end(), (int)s) != defaultRows.end())
+					continue;
+				for(size_t d = 0; d < defaultRows.size(); ++d){
+					vector<unsigned char> cls;
+					for(int c = 0; c < numClasses; ++c)
+						if(ref[s*numClasses + c] != ref[defaultRows[d]*numClasses + c])
+							cls.push_back(c);
+					if(cls.size() < others[s].size()){
+						bases[s].defaultRow = defaultRows[d];
+						others[s].swap(cls);
+					}
+				}
+			}
+
+			//the rows with the most classes are placed first, while slots are free; each row at the
+			//lowest base where every class it keeps falls on a free slot. nextFree skips the taken
+			//slots, pointing at or before the first free slot after each (path halving, as in union find)
+			vector<std::pair<int, int> > order;
+			for(size_t s = 0; s < states.size(); ++s)
+				order.push_back(std::make_pair(-(int)others[s].size(), (int)s));
+			std::sort(order.begin(), order.end());
+			vector<int> nextFree;
+			slot none = {-1, 0};
+			for(size_t o = 0; o < order.size(); ++o){
+				int s = order[o].second;
+				const vector<unsigned char> &cls = others[s];
+				bases[s].base = 0;
+				if(cls.empty())
+					continue;
+				int base;
+				for(int at = freeSlot(nextFree, cls[0]); ; at = freeSlot(nextFree, at + 1)){
+					base = at - cls[0];
+					size_t i = 1;
+					while(i < cls.size() and (base + cls[i] >= (int)slots.size() or slots[base + cls[i]].check < 0))
+						++i;
+					if(i == cls.size())
+						break;
+				}
+				bases[s].base = base;
+				while((int)slots.size() < base + numClasses){
+					nextFree.push_back(slots.size());
+					slots.push_back(none);
+				}
+				for(size_t i = 0; i < cls.size(); ++i){
+					slots[base + cls[i]].check = s;
+					slots[base + cls[i]].next = ref[s*numClasses + cls[i]];
+					nextFree[base + cls[i]] = base + cls[i] + 1;
+				}
+			}
+			//rows keeping no classes keep base 0, so every lookup must stay inside the slots
+			if((int)slots.size() < numClasses)
+				slots.resize(numClasses, none);
+		}
+		vector<entry>().swap(table);
+		vector<int>().swap(plainRow);
+		layout = kind;
+	}
+
+	/// @brief Bytes taken by the transitions in the current layout
+	size_t bytes() const{
+		if(layout == DENSE)
+			return table.size() * sizeof(entry) + plainRow.size() * sizeof(int);
+		if(layout == DISPLACED)
+			return pool.size() * sizeof(entry) + bases.size() * sizeof(displacedRow) + slots.size() * sizeof(slot);
+		return pool.size() * sizeof(entry) + rows.size() * sizeof(rowRef) + labels.size() + targets.size() * sizeof(unsigned);
+	}
+
+	/// @brief Look up the compiled transition out of a state for an input symbol
+	/// @param state Index of the current state
+	/// @param c An input symbol to transition with.
+	const entry &step(int state, char c) const {
+		if(layout == DENSE)
+			return table[state*numClasses + byteClass[(unsigned char)c]];
+		if(layout == DISPLACED){
+			unsigned char cls = byteClass[(unsigned char)c];
+			const displacedRow *r = &bases[state];
+			const slot *t = &slots[r->base + cls];
+			if(t->check == state)
+				return pool[t->next];
+			if(r->defaultRow < 0)
+				return pool[r->fallback];
+			//default states have no default of their own
+			state = r->defaultRow;
+			r = &bases[state];
+			t = &slots[r->base + cls];
+			return pool[t->check == state ? t->next : r->fallback];
+		}
+		return sparseStep(state, byteClass[(unsigned char)c]);
+	}
+
+	/// @brief First free slot at or after at, displaced layout; past the slots every slot is free
+	static int freeSlot(vector<int> &nextFree, int at){
+		while(at < (int)nextFree.size() and nextFree[at] != at){
+			if(nextFree[at] < (int)nextFree.size())
+				nextFree[at] = nextFree[nextFree[at]];
+			at = nextFree[at];
+		}
+		return at;
+	}
+
+	/// @brief The transition out of a state for a byte class in the hybrid layout
+	const entry &sparseStep(int state, unsigned char cls) const {
+		const rowRef &r = rows[state];
+		if(r.count < 0)
+			return pool[targets[r.targets + cls]];
+#ifdef __SSE2__
+		__m128i hit = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&labels[r.labels]), _mm_set1_epi8((char)cls));
+		int mask = _mm_movemask_epi8(hit) & ((1 << r.count) - 1);
+		return pool[mask ? targets[r.targets + __builtin_ctz(mask)] : r.fallback];
+#else
+		for(int i = 0; i < r.count; ++i)
+			if(labels[r.labels + i] == cls)
+				return pool[targets[r.targets + i]];
+		return pool[r.fallback];
+#endif
+	}
+
+	/// @brief Starts loading the transition step() will look up, so it is cached by then
+	void prefetch(int state, char c) const {
+		if(layout == DENSE)
+			__builtin_prefetch(&table[state*numClasses + byteClass[(unsigned char)c]]);
+		else if(layout == DISPLACED)
+			__builtin_prefetch(&bases[state]);
+		else
+			__builtin_prefetch(&rows[state]);
+	}
+};
+
+
+/// @brief Seconds since the epoch with microsecond resolution, for throughput reporting
+double now(){
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//Globals:
+/// @brief holds a queue of spam message IDs as they are identified
+list<int> spamMessages;
+
+/// @brief The parsed message ID of the current message
+int currentMessageNum;
+
+/// @brief A spam keyword or phrase to match in message bodies
+struct keyword{
+	string text;	///< @brief The keyword, words of a phrase separated by single spaces
+	int fuzz;		///< @brief Maximum edit (Levenshtein) distance accepted, -1 until the default is applied
+	bool ham;		///< @brief An allowlist keyword, vetoing the spam verdict of its message
+	bool inRule;	///< @brief Named by a document rule, so finding it alone does not make a message spam
+
+	/// @brief Builds a keyword from its text and edit distance
+	keyword(const string &t, int f = -1, bool h = false){ text = t; fuzz = f; ham = h; inRule = false; }
+};
+
+/// @brief All keywords matched by the automaton
+vector<keyword> keywords;
+
+/// @brief A proximity term: keywords a and b found within a number of words of each other
+struct nearTerm{
+	int a;		///< @brief Index of the first keyword
+	int b;		///< @brief Index of the second keyword
+	int words;	///< @brief Largest distance in words between the two
+};
+
+/// @brief All proximity terms named by the document rules
+vector<nearTerm> nearTerms;
+
+/// @brief A document rule: the message is spam if all of need and none of without are found in it
+struct rule{
+	vector<int> need;			///< @brief Keywords which must all be found
+	vector<int> needCount;		///< @brief Times each keyword of need must be found
+	vector<int> without;		///< @brief Keywords which must not be found
+	vector<int> withoutCount;	///< @brief Times each keyword of without may not be found
+	vector<int> nearNeed;		///< @brief Proximity terms which must all hold
+	vector<int> nearWithout;	///< @brief Proximity terms which must not hold
+	long within;				///< @brief Only keywords ending in the first within bytes of the body count, 0 for the whole body
+
+	rule(){ within = 0; }
+};
+
+/// @brief The document rules given on the command line
+/// @note Every spam keyword not named by a rule also acts as a rule of its own
+vector<rule> rules;
+
+/// @brief Indexes of the rules with a scope (within > 0)
+vector<int> scopedRules;
+
+/// @brief Largest number of body bytes scanned per message, 0 for no limit
+long maxScanDepth = 0;
+
+/// @brief Largest number of bytes scanned per message before it is left undecided, 0 for no limit
+long docByteBudget = 0;
+
+/// @brief Longest time in seconds spent per message before it is left undecided, 0 for no limit
+double docTimeBudget = 0;
+
+/// @brief The time budget is checked whenever the input offset is a multiple of this, a power of two
+const long budgetCheckInterval = 4096;
+
+/// @brief How far ahead of the scan the input is prefetched, in bytes, 0 to leave it to the hardware
+long prefetchDistance = 0;
+
+/// @brief Scan batches of whole messages several at a time in vector lanes, where the CPU has AVX2
+bool laneStepping = true;
+
+/// @brief Messages left undecided by a budget, with the offset into the message reached
+list<std::pair<int, long> > undecidedMessages;
+
+/// @brief Keywords completed together by one transition, indexed by the argument of recordAccept
+vector<vector<int> > acceptSets;
+
+/// @brief Outcome of the rules for the current message
+enum verdict{
+	UNDECIDED,	///< @brief Keywords found later may still change the outcome
+	SPAM,		///< @brief The message is spam whatever follows
+	NOT_SPAM	///< @brief The message is not spam whatever follows
+};
+
+/// @brief Does the rule set have allowlist keywords, which can veto a spam verdict up to </DOC>
+bool hamKeywords;
+
+/// @brief Does the rule set have spam keywords acting as rules of their own
+bool aloneKeywords;
+
+/// @brief Bitset of the keywords found in the current message
+vector<bool> docHits;
+
+/// @brief Indexes of the bits set in docHits, so they are cleared without touching every keyword
+vector<int> docHitList;
+
+/// @brief Times each keyword was found in the current message, saturating at 255
+/// @note Only meaningful for keywords in docHitList
+vector<unsigned char> docCount;
+
+/// @brief Proximity terms naming each keyword
+vector<vector<int> > nearByKeyword;
+
+/// @brief Bitset of the proximity terms holding in the current message
+vector<bool> docNear;
+
+/// @brief Indexes of the bits set in docNear
+vector<int> docNearList;
+
+/// @brief Outcome of each scoped rule once the scan has passed its scope, 0 while it is open
+vector<char> docFrozen;
+
+/// @brief Indexes of the rules set in docFrozen
+vector<int> docFrozenList;
+
+/// @brief Values of docFrozen
+enum{ FROZEN_FAILED = 1, FROZEN_HOLDS = 2 };
+
+/// @brief Offset in the input of the byte being scanned
+long streamOffset;
+
+/// @brief Input offset of the first body byte of the current message
+long docBodyStart;
+
+/// @brief Input offset at which the scan of the current body stops, past maxScanDepth or docByteBudget
+long docScanLimit;
+
+/// @brief Input offset of the <DOC> tag of the current message
+long docStart;
+
+/// @brief When the current message would have started had it been scanned without a break, only kept with a time budget.
+/// A stream swapped out keeps the time scanned instead (docState::swap), so time waiting between slices is not counted.
+double docStartTime;
+
+/// @brief Has the current message run out of budget, leaving it undecided
+bool docOverBudget;
+
+/// @brief Offset into the current message where its budget ran out
+long docBudgetAt;
+
+/// @brief Word position of the last hit of each keyword found in the current message
+vector<int> docLastWord;
+
+/// @brief Number of words read in the current message body, only counted when there are proximity terms
+int docWord;
+
+/// @brief Has a keyword acting as a rule of its own been found in the current message
+bool docSpam;
+
+/// @brief Has an allowlist keyword been found in the current message
+bool docHam;
+
+/// @brief Is a message open, its <DOC> read but not its </DOC>
+bool docOpen;
+
+/// @brief Outcome of the current message, once it is known
+verdict docVerdict;
+
+/// @brief Set when docVerdict has just been reached, telling the scanner to skip to </DOC>
+bool verdictReached;
+
+/// @brief Outcome of the last message ended, UNDECIDED if a budget left it so
+verdict lastVerdict;
+
+/// @brief Number of messages ended so far
+long docsEnded;
+
+/// @brief A message ended by endDoc
+struct endedDoc{
+	int id;				///< @brief Number of its DOCID
+	verdict outcome;	///< @brief Its outcome, UNDECIDED if a budget left it so
+	long start;			///< @brief Offset of its <DOC> tag in the stream
+};
+
+/// @brief Where endDoc also lists each message it ends, NULL for nowhere
+vector<endedDoc>* endedMessages = NULL;
+
+/// @brief Fills in the rule set settings, to be called once the keywords and rules are final
+void setupRules(){
+	hamKeywords = aloneKeywords = false;
+	for(size_t i = 0; i < keywords.size(); ++i){
+		hamKeywords = hamKeywords or keywords[i].ham;
+		aloneKeywords = aloneKeywords or (!keywords[i].ham and !keywords[i].inRule);
+	}
+	docHits.assign(keywords.size(), false);
+	docHitList.clear();
+	docLastWord.assign(keywords.size(), 0);
+	docCount.assign(keywords.size(), 0);
+	docNear.assign(nearTerms.size(), false);
+	docNearList.clear();
+	docFrozen.assign(rules.size(), 0);
+	docFrozenList.clear();
+	scopedRules.clear();
+	for(size_t i = 0; i < rules.size(); ++i)
+		if(rules[i].within > 0) scopedRules.push_back(i);
+	docScanLimit = LONG_MAX;
+	nearByKeyword.assign(keywords.size(), vector<int>());
+	for(size_t i = 0; i < nearTerms.size(); ++i){
+		nearByKeyword[nearTerms[i].a].push_back(i);
+		if(nearTerms[i].b != nearTerms[i].a)
+			nearByKeyword[nearTerms[i].b].push_back(i);
+	}
+}
+
+/// @brief Does a rule hold for the keywords found so far
+/// @param i Index of the rule in rules
+bool ruleHolds(size_t i){
+	if(docFrozen[i])
+		return docFrozen[i] == FROZEN_HOLDS;
+	const rule &r = rules[i];
+	for(size_t k = 0; k < r.need.size(); ++k)
+		if(!docHits[r.need[k]] or docCount[r.need[k]] < r.needCount[k]) return false;
+	for(size_t k = 0; k < r.without.size(); ++k)
+		if(docHits[r.without[k]] and docCount[r.without[k]] >= r.withoutCount[k]) return false;
+	for(size_t k = 0; k < r.nearNeed.size(); ++k)
+		if(!docNear[r.nearNeed[k]]) return false;
+	for(size_t k = 0; k < r.nearWithout.size(); ++k)
+		if(docNear[r.nearWithout[k]]) return false;
+	return true;
+}
+
+/// @brief Can a rule no longer hold, whatever else is found in the message
+/// @param i Index of the rule in rules
+bool ruleFailed(size_t i){
+	if(docFrozen[i])
+		return docFrozen[i] == FROZEN_FAILED;
+	const rule &r = rules[i];
+	for(size_t k = 0; k < r.without.size(); ++k)
+		if(docHits[r.without[k]] and docCount[r.without[k]] >= r.withoutCount[k]) return true;
+	for(size_t k = 0; k < r.nearWithout.size(); ++k)
+		if(docNear[r.nearWithout[k]]) return true;
+	return false;
+}
+
+/// @brief Checks whether the keywords found so far settle the current message
+void decide(){
+	if(docVerdict != UNDECIDED)
+		return;
+	if(docHam){
+		docVerdict = NOT_SPAM;
+	}else{
+		bool holds = docSpam;		//some rule holds and can not be broken by a keyword found later
+		bool open = aloneKeywords;	//some rule may still come to hold
+		for(size_t i = 0; i < rules.size(); ++i){
+			bool final = docFrozen[i] or (rules[i].without.empty() and rules[i].nearWithout.empty());
+			if(ruleHolds(i) and final)
+				holds = true;
+			else if(!ruleFailed(i))
+				open = true;
+		}
+		if(holds and !hamKeywords)
+			docVerdict = SPAM;
+		else if(!holds and !open)
+			docVerdict = NOT_SPAM;
+	}
+	verdictReached = docVerdict != UNDECIDED;
+	if(verdictReached)
+		docScanLimit = LONG_MAX;
+}
+
+/// @brief Transition action used to report a string has been accepted
+void sayAccepted(char, int){
+	cout << "Accepted" << endl;
+}
+
+/// @brief Transition action starting a new message, resetting the message ID to zero and clearing the keywords found
+void newMsg(char, int){
+	currentMessageNum = 0;
+	for(size_t i = 0; i < docHitList.size(); ++i)
+		docHits[docHitList[i]] = false;
+	docHitList.clear();
+	for(size_t i = 0; i < docNearList.size(); ++i)
+		docNear[docNearList[i]] = false;
+	docNearList.clear();
+	for(size_t i = 0; i < docFrozenList.size(); ++i)
+		docFrozen[docFrozenList[i]] = 0;
+	docFrozenList.clear();
+	docStart = streamOffset - 4;
+	docBodyStart = LONG_MAX;
+	docScanLimit = docByteBudget > 0 ? docStart + docByteBudget : LONG_MAX;
+	docOverBudget = false;
+	if(docTimeBudget > 0)
+		docStartTime = now();
+	docWord = 0;
+	docSpam = docHam = false;
+	docVerdict = UNDECIDED;
+	verdictReached = false;
+	docOpen = true;
+}
+
+/// @brief Transition action making the given input symbol digit the new ones place of the current message ID
+/// @param c the ASCII digit to reinterpret as the new one's place
+/// @note previous value multiplied by 10 become the 10s place and beyond
+void handleMIDdig(char c, int){
+	int digit = c - '0';
+	currentMessageNum *= 10;
+	currentMessageNum += digit;
+}
+
+/// @brief Transition action marking the start of the message body, the byte after the current one
+void startBody(char, int){
+	docBodyStart = streamOffset + 1;
+	if(maxScanDepth > 0 and docBodyStart + maxScanDepth < docScanLimit)
+		docScanLimit = docBodyStart + maxScanDepth;
+}
+
+/// @brief Leaves the current message undecided, having run out of budget
+/// @param at Offset into the message reached
+void outOfBudget(long at){
+	docOverBudget = true;
+	docBudgetAt = at;
+	docScanLimit = LONG_MAX;
+}
+
+/// @brief Has the current message used up its time budget
+bool outOfTime(){
+	return docTimeBudget > 0 and docOpen and docVerdict == UNDECIDED and !docOverBudget
+		and now() - docStartTime >= docTimeBudget;
+}
+
+/// @brief Settles the scoped rules whose scope ends before a keyword hit
+/// @param at Offset of the hit in the message body
+void freezeScopes(long at){
+	for(size_t i = 0; i < scopedRules.size(); ++i){
+		int r = scopedRules[i];
+		if(!docFrozen[r] and at >= rules[r].within){
+			docFrozen[r] = ruleHolds(r) ? FROZEN_HOLDS : FROZEN_FAILED;
+			docFrozenList.push_back(r);
+		}
+	}
+}
+
+/// @brief Transition action counting the end of a word in the message body
+void nextWord(char, int){
+	++docWord;
+}
+
+/// @brief Notes a keyword found in the current message
+/// @param kw Index of the keyword in keywords
+void foundKeyword(int kw){
+	//proximity terms hold once the other keyword was last seen close enough
+	for(size_t i = 0; i < nearByKeyword[kw].size(); ++i){
+		int t = nearByKeyword[kw][i];
+		int other = nearTerms[t].a == kw ? nearTerms[t].b : nearTerms[t].a;
+		if(!docNear[t] and docHits[other] and docWord - docLastWord[other] <= nearTerms[t].words){
+			docNear[t] = true;
+			docNearList.push_back(t);
+		}
+	}
+	docLastWord[kw] = docWord;
+
+	if(docHits[kw]){
+		if(docCount[kw] < 255)
+			++docCount[kw];
+		return;
+	}
+	docHits[kw] = true;
+	docCount[kw] = 1;
+	docHitList.push_back(kw);
+	if(keywords[kw].ham)
+		docHam = true;
+	else if(!keywords[kw].inRule)
+		docSpam = true;
+}
+
+/// @brief Transition action noting the keywords completed by the transition, then checking the rules
+/// @param set Index of the completed keywords in acceptSets
+void recordAccept(char, int set){
+	const vector<int> &found = acceptSets[set];
+	freezeScopes(streamOffset - docBodyStart);
+	for(size_t i = 0; i < found.size(); ++i)
+		foundKeyword(found[i]);
+	decide();
+}
+
+/// @brief Transition action noting the keywords completed by the transition, which also ends a word
+/// @param set Index of the completed keywords in acceptSets
+void recordAcceptWord(char c, int set){
+	recordAccept(c, set);
+	++docWord;
+}
+
+/// @brief Transition action deciding the current message at its </DOC>
+/// @note A message is spam if a rule holds and no allowlist keyword was found
+void endDoc(char, int){
+	if(docOpen){
+		if(docOverBudget){
+			undecidedMessages.push_back(std::make_pair(currentMessageNum, docBudgetAt));
+			lastVerdict = UNDECIDED;
+		}else{
+			bool spam = docVerdict == SPAM;
+			if(docVerdict == UNDECIDED and !docHam){
+				spam = docSpam;
+				for(size_t i = 0; i < rules.size(); ++i)
+					spam = spam or ruleHolds(i);
+			}
+			if(spam)
+				spamMessages.push_back(currentMessageNum);
+			lastVerdict = spam ? SPAM : NOT_SPAM;
+		}
+		++docsEnded;
+		if(endedMessages != NULL){
+			endedDoc e = {currentMessageNum, lastVerdict, docStart};
+			endedMessages->push_back(e);
+		}
+	}
+	docOpen = false;
+	verdictReached = false;
+	docScanLimit = LONG_MAX;
+}
+
+/// @brief The message state of one input stream: the globals the edge actions work on.
+/// While a stream is scanned its state lives in the globals, swap() exchanges it with
+/// the copy held here, suspending that stream and resuming the one saved in this object.
+struct docState{
+	long offset;				///< @brief streamOffset
+	int messageNum;				///< @brief currentMessageNum
+	vector<bool> hits;			///< @brief docHits
+	vector<int> hitList;		///< @brief docHitList
+	vector<unsigned char> count;	///< @brief docCount
+	vector<bool> nearHits;		///< @brief docNear
+	vector<int> nearList;		///< @brief docNearList
+	vector<char> frozen;		///< @brief docFrozen
+	vector<int> frozenList;		///< @brief docFrozenList
+	vector<int> lastWord;		///< @brief docLastWord
+	int word;					///< @brief docWord
+	long bodyStart;				///< @brief docBodyStart
+	long scanLimit;				///< @brief docScanLimit
+	long start;					///< @brief docStart
+	double startTime;			///< @brief Time scanned of the current message, docStartTime counted back from now
+	bool overBudget;			///< @brief docOverBudget
+	long budgetAt;				///< @brief docBudgetAt
+	bool spam;					///< @brief docSpam
+	bool ham;					///< @brief docHam
+	bool open;					///< @brief docOpen
+	verdict outcome;			///< @brief docVerdict
+	bool reached;				///< @brief verdictReached
+
+	/// @brief The state of a stream before its first byte, sized for the keywords and rules of setupRules()
+	docState(){
+		offset = 0;
+		messageNum = 0;
+		hits.assign(keywords.size(), false);
+		count.assign(keywords.size(), 0);
+		lastWord.assign(keywords.size(), 0);
+		nearHits.assign(nearTerms.size(), false);
+		frozen.assign(rules.size(), 0);
+		word = 0;
+		bodyStart = scanLimit = LONG_MAX;
+		start = 0;
+		startTime = 0;
+		overBudget = false;
+		budgetAt = 0;
+		spam = ham = open = reached = false;
+		outcome = UNDECIDED;
+	}
+
+	/// @brief Exchanges this state with the one in the globals
+	void swap(){
+		std::swap(streamOffset, offset);
+		std::swap(currentMessageNum, messageNum);
+		docHits.swap(hits);
+		docHitList.swap(hitList);
+		docCount.swap(count);
+		docNear.swap(nearHits);
+		docNearList.swap(nearList);
+		docFrozen.swap(frozen);
+		docFrozenList.swap(frozenList);
+		docLastWord.swap(lastWord);
+		std::swap(docWord, word);
+		std::swap(docBodyStart, bodyStart);
+		std::swap(docScanLimit, scanLimit);
+		std::swap(docStart, start);
+		if(docTimeBudget > 0){
+			double t = now();
+			double scanned = t - docStartTime;
+			docStartTime = t - startTime;
+			startTime = scanned;
+		}
+		std::swap(docOverBudget, overBudget);
+		std::swap(docBudgetAt, budgetAt);
+		std::swap(docSpam, spam);
+		std::swap(docHam, ham);
+		std::swap(docOpen, open);
+		std::swap(docVerdict, outcome);
+		std::swap(verdictReached, reached);
+	}
+};
+
+/// @brief A resumable scan of one input stream over the compiled automaton.
+/// Its whole state is the automaton state and the docState of the stream, so the scan can
+/// stop after any byte and go on later from the same point, with other streams scanned in between.
+class scanner{
+	const DFAtable &dfa;
+	int spamState, skipState;		///< @brief States the scan jumps to once the rules settle a message
+	const vector<int> &skipFrom;	///< @brief Where the scan depth and budget jumps land from each state
+
+public:
+	int state;		///< @brief Index of the current automaton state, -1 after an unhandled symbol
+	docState doc;	///< @brief Message state of the stream, while it is not being scanned
+	bool trace;		///< @brief Print every transition taken to standard output
+
+	/// @param d The compiled automaton, start is state 0
+	/// @param spam Index of isSpam
+	/// @param skip Index of skipDoc
+	/// @param from Where to jump from each state when a scan limit is reached
+	scanner(const DFAtable &d, int spam, int skip, const vector<int> &from)
+		: dfa(d), spamState(spam), skipState(skip), skipFrom(from){
+		state = 0;
+		trace = false;
+	}
+
+private:
+	/// @brief Steps over bytes with the stream's docState in the globals
+	/// @return false if a byte had no transition
+	bool run(const char* p, const char* end){
+		return prefetchDistance > 0 ? steps<true>(p, end) : steps<false>(p, end);
+	}
+
+	/// @brief The loop of run(), compiled with and without the input prefetch so -p 0 pays nothing per byte
+	template<bool prefetching>
+	bool steps(const char* p, const char* end){
+		const char* nextPrefetch = p;
+		for(; p < end and state >= 0; ++p){
+			//one prefetch per cache line of input
+			if(prefetching and p >= nextPrefetch){
+				__builtin_prefetch(p + prefetchDistance);
+				nextPrefetch = p + 64;
+			}
+			if(trace){
+				//print the "name" of the current state and an arrow showing the input character for the transition
+				cout << '\"'<< dfa.states[state]->name << '\"';
+				cout << '-' << *p << "->";
+			}
+
+			//transition out of the current state using the input symbol
+			const DFAtable::entry &t = dfa.step(state, *p);
+			state = t.to;
+			if(state < 0){
+				cerr << "Error: Unhandled symbol:" << *p << endl;
+				break;
+			}
+			if(t.doing != NULL){
+				t.doing(*p, t.arg);
+				//skip to the end of the message once its verdict can not change, keeping a partly read </DOC>
+				if(verdictReached){
+					verdictReached = false;
+					state = docVerdict == SPAM and skipFrom[state] == skipState ? spamState : skipFrom[state];
+				}
+			}
+			++streamOffset;
+			//stop scanning a message at the scan depth or its byte budget
+			if(streamOffset >= docScanLimit){
+				if(docByteBudget > 0 and streamOffset - docStart >= docByteBudget)
+					outOfBudget(streamOffset - docStart);
+				docScanLimit = LONG_MAX;
+				state = skipFrom[state];
+			}
+			//and every few KB check the time budget
+			if((streamOffset & (budgetCheckInterval - 1)) == 0 and outOfTime()){
+				outOfBudget(streamOffset - docStart);
+				state = skipFrom[state];
+			}
+		}
+		return state >= 0;
+	}
+
+public:
+	/// @brief A whole message scanned by scanBatch()
+	struct batchItem{
+		const char* p;		///< @brief Start of the message
+		const char* end;	///< @brief One past the end of the message
+		long offset;		///< @brief Offset of the message in the input
+		bool ended;			///< @brief Set if it held a whole message
+		verdict outcome;	///< @brief Set to its outcome, UNDECIDED if a budget left it so
+	};
+
+private:
+#if defined(__x86_64__) and defined(__GNUC__)
+	/// @brief Number of messages scanLanes() steps together, one per 32 bit lane of an AVX2 vector
+	static const int LANES = 8;
+
+	/// @brief Batches of messages shorter than this on average are scanned one message at a time.
+	/// Every header takes the scalar loop for its edge actions, which leaves too little of a short
+	/// message for the lanes to make up for swapping its docState in and out.
+	static const long laneMinBytes = 512;
+
+	/// @brief One message being stepped by scanLanes()
+	struct lane{
+		const char* p;		///< @brief Next byte to scan
+		const char* stop;	///< @brief Byte the scalar loop must take for a scan limit, or the end
+		const char* synced;	///< @brief Position of the lane when doc.offset was last brought up to date
+		batchItem* item;	///< @brief Its message, NULL for an idle lane
+		docState doc;		///< @brief Its message state, while it is not in the globals
+	};
+	vector<lane> lanes;
+
+	/// @brief Sets how far a lane may be stepped without the scalar loop, short of the byte that reaches its scan limit
+	void setStop(lane &l){
+		long room = l.doc.scanLimit == LONG_MAX ? LONG_MAX : std::max(0L, l.doc.scanLimit - l.doc.offset - 1);
+		l.stop = room < l.item->end - l.p ? l.p + room : l.item->end;
+	}
+
+	/// @brief Runs a lane through the scalar loop with its docState in the globals, from its next byte
+	/// until 8 bytes in a row take transitions without an edge action, or to its end with last set,
+	/// deciding the message then
+	/// @param row Start of the lane's state's row, updated
+	/// @return false if a byte had no transition
+	bool settle(lane &l, int &row, bool last){
+		l.doc.offset += l.p - l.synced;
+		l.doc.swap();
+		long ended = docsEnded;
+		state = row / dfa.numClasses;
+		for(int quiet = 0; l.p < l.item->end and state >= 0 and (quiet < 8 or last); ++l.p){
+			quiet = dfa.plainRow[state * dfa.numClasses + dfa.byteClass[(unsigned char)*l.p]] >= 0 ? quiet + 1 : 0;
+			run(l.p, l.p + 1);
+		}
+		bool ok = state >= 0;
+		if(ok and last)
+			endDoc(0, 0);
+		if(docsEnded != ended){
+			l.item->ended = true;
+			l.item->outcome = lastVerdict;
+		}
+		row = std::max(state, 0) * dfa.numClasses;
+		l.doc.swap();
+		l.synced = l.p;
+		setStop(l);
+		return ok;
+	}
+
+	/// @brief Steps the lanes together until one of them needs the scalar loop: its next byte
+	/// takes a transition with an edge action, or it has reached its stop
+	/// @param rows Start of each lane's state's row, updated
+	/// @return Mask of the lanes needing the scalar loop
+	__attribute__((target("avx2")))
+	int stepLanes(int* rows){
+		const char* q[LANES];
+		int live = 0, first = -1;
+		long steps = LONG_MAX;
+		for(int i = 0; i < LANES; ++i){
+			if(lanes[i].item == NULL)
+				continue;
+			live |= 1 << i;
+			first = first < 0 ? i : first;
+			steps = std::min(steps, (long)(lanes[i].stop - lanes[i].p));
+		}
+		//idle lanes read along with a live one, their results are masked off
+		for(int i = 0; i < LANES; ++i)
+			q[i] = lanes[live >> i & 1 ? i : first].p;
+		__m256i liveMask = _mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(live),
+			_mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)), _mm256_setzero_si256());
+		__m256i row = _mm256_loadu_si256((const __m256i*)rows);
+		int bad = 0;
+		long t;
+		for(t = 0; t < steps; ++t){
+			int classes[LANES] __attribute__((aligned(32)));
+			for(int i = 0; i < LANES; ++i)
+				classes[i] = dfa.byteClass[(unsigned char)q[i][t]];
+			__m256i next = _mm256_mask_i32gather_epi32(row, &dfa.plainRow[0],
+				_mm256_add_epi32(row, _mm256_load_si256((const __m256i*)classes)), liveMask, 4);
+			bad = _mm256_movemask_ps(_mm256_castsi256_ps(next)) & live;
+			if(bad){
+				//the other lanes still take this byte
+				row = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(next),
+					_mm256_castsi256_ps(row), _mm256_castsi256_ps(next)));
+				break;
+			}
+			row = next;
+		}
+		_mm256_storeu_si256((__m256i*)rows, row);
+		for(int i = 0; i < LANES; ++i){
+			if(!(live >> i & 1))
+				continue;
+			lanes[i].p += t + (t < steps and !(bad >> i & 1));
+			if(lanes[i].p == lanes[i].stop)
+				bad |= 1 << i;
+		}
+		return bad;
+	}
+
+	/// @brief scanBatch() stepping LANES messages at a time: the messages are held in the lanes of a
+	/// vector and their next states gathered from the table together, so the table loads of
+	/// different messages overlap instead of each waiting on the one before. A lane whose next
+	/// transition has an edge action, or which reaches a scan limit, swaps its docState into the
+	/// globals and takes the scalar loop until it is quiet again.
+	bool scanLanes(batchItem* items, size_t count){
+		if(lanes.empty())
+			lanes.resize(LANES);
+		int rows[LANES] = {0};
+		size_t next = 0;
+		bool ok = true;
+		for(size_t i = 0; i < count; ++i)
+			items[i].ended = false;
+		for(int i = 0; i < LANES; ++i)
+			lanes[i].item = NULL;
+		while(ok){
+			//fill idle lanes with the next messages
+			int live = 0;
+			for(int i = 0; i < LANES; ++i){
+				lane &l = lanes[i];
+				if(l.item == NULL and next < count){
+					l.item = &items[next++];
+					l.item->outcome = UNDECIDED;
+					l.p = l.synced = l.item->p;
+					l.doc.offset = l.item->offset;
+					rows[i] = 0;
+					setStop(l);
+				}
+				live += l.item != NULL;
+			}
+			if(live == 0)
+				break;
+
+			int attend = stepLanes(rows);
+			for(int i = 0; i < LANES and ok; ++i){
+				lane &l = lanes[i];
+				if(!(attend >> i & 1))
+					continue;
+				bool last = l.p == l.item->end;
+				ok = settle(l, rows[i], last);
+				if(last)
+					l.item = NULL;
+			}
+		}
+		if(!ok)
+			for(int i = 0; i < LANES; ++i)
+				if(lanes[i].item != NULL)
+					lanes[i].item->ended = false;
+		return ok;
+	}
+#endif
+
+public:
+
+	/// @brief Scans the next bytes of the stream
+	/// @param p Start of the bytes
+	/// @param end One past the end of the bytes
+	/// @return false if a byte had no transition, the scan can not go on
+	bool feed(const char* p, const char* end){
+		doc.swap();
+		bool ok = run(p, end);
+		doc.swap();
+		return ok;
+	}
+
+	/// @brief Scans whole messages one after another, each as a stream of its own, in a single
+	/// resumption of the scanner, so the docState is swapped in and out once for the lot
+	/// @param items The messages, their outcomes are filled in
+	/// @param count Number of messages
+	/// @return false if a byte had no transition, the items from the failing one on are not ended
+	bool scanBatch(batchItem* items, size_t count){
+#if defined(__x86_64__) and defined(__GNUC__)
+		//a message in a lane shares the wall time with the others, so time budgets keep to one at a time
+		if(laneStepping and !trace and docTimeBudget == 0 and count > 1 and !dfa.plainRow.empty()
+				and __builtin_cpu_supports("avx2")){
+			long bytes = 0;
+			for(size_t i = 0; i < count; ++i)
+				bytes += items[i].end - items[i].p;
+			if(bytes >= (long)count * laneMinBytes)
+				return scanLanes(items, count);
+		}
+#endif
+		doc.swap();
+		bool ok = true;
+		for(size_t i = 0; i < count; ++i){
+			//the next message loads while this one is scanned, it starts in the start state's row, which is cached
+			if(prefetchDistance > 0 and i + 1 < count and items[i+1].p < items[i+1].end)
+				__builtin_prefetch(items[i+1].p);
+			long ended = docsEnded;
+			state = 0;
+			streamOffset = items[i].offset;
+			ok = ok and run(items[i].p, items[i].end);
+			if(ok)
+				endDoc(0, 0);
+			items[i].ended = ok and docsEnded != ended;
+			items[i].outcome = lastVerdict;
+		}
+		doc.swap();
+		return ok;
+	}
+
+	/// @brief Ends the stream, deciding a message left open
+	void finish(){
+		doc.swap();
+		endDoc(0, 0);
+		doc.swap();
+	}
+
+	/// @brief Starts the scanner over on a new stream, reusing its message state
+	/// @param offset Offset of the stream in the input
+	void restart(long offset){
+		state = 0;
+		doc.open = false;
+		doc.scanLimit = LONG_MAX;
+		doc.offset = offset;
+	}
+};
+
+/// @brief Scans messages held in memory one job per message, time slicing the long ones.
+/// A job runs for at most quantum bytes and then goes back into the queue, so the
+/// short messages queued behind a long one finish in their first slice instead of waiting
+/// for the whole long message. A job only holds a scanner from its first slice to its
+/// </DOC>, then the scanner is reused for the next job started.
+///
+/// Jobs are queued first come first served, or with aging set, shortest remaining message
+/// first: a waiting job moves ahead by one byte of size per aging bytes scanned meanwhile,
+/// so long messages are not starved. Messages over largeSize bytes get a queue of their own,
+/// which takes turns with the queue of the others as a second worker would.
+class scheduler{
+	/// @brief A message waiting for its next slice
+	struct job{
+		const char* p;		///< @brief Next byte to scan
+		const char* end;	///< @brief One past the end of the message
+		long offset;		///< @brief Offset of the message in the input
+		long size;			///< @brief Length of the whole message
+		scanner* scan;		///< @brief The suspended scan, NULL until the first slice
+		double submitted;	///< @brief When the job was queued
+		long tag;			///< @brief Caller's name for the job, handed back with its outcome
+	};
+
+	/// @brief Jobs by the key of their next slice, lowest first
+	typedef std::multimap<long, job> queue;
+
+	const DFAtable &dfa;
+	int spamState, skipState;
+	const vector<int> &skipFrom;
+	queue pools[2];				///< @brief Queued jobs of the messages up to largeSize bytes, and of the larger ones
+	int turn;					///< @brief Pool of the next slice, when both have jobs
+	long clock;					///< @brief Bytes scanned so far, the time aging is counted in
+	vector<scanner*> idle;		///< @brief Scanners free for the next job started
+	vector<scanner::batchItem> items;	///< @brief Messages of the batch being run
+
+	/// @brief Queues a job under the key of its next slice
+	void enqueue(const job &j){
+		long key = aging > 0 ? (j.end - j.p) * aging + clock : clock;
+		pools[largeSize > 0 and j.size > largeSize ? 1 : 0].insert(std::make_pair(key, j));
+	}
+
+public:
+	/// @brief A job run to its end
+	struct result{
+		long tag;			///< @brief The tag given to submit()
+		bool ended;			///< @brief Did the job hold a whole message
+		verdict outcome;	///< @brief Outcome of the message, UNDECIDED if a budget left it so
+	};
+
+	list<result> finished;	///< @brief Jobs run to their end, only kept if keepResults is set
+	bool keepResults;		///< @brief Record every job run to its end in finished
+
+	long quantum;		///< @brief Most bytes scanned per slice
+	long aging;			///< @brief Bytes scanned per byte a waiting job moves ahead, 0 to queue jobs in arrival order
+	long largeSize;		///< @brief Messages over this many bytes are queued on their own, 0 for a single queue
+
+	long slices;		///< @brief Number of slices run
+	long jobs;			///< @brief Number of jobs run to their end
+	long batches;		///< @brief Number of slices running several short jobs whole
+	size_t batchSize;	///< @brief Most short jobs run in one slice, 1 to run each on its own
+	size_t maxDepth;	///< @brief Most jobs queued at the start of a slice
+	double sumDepth;	///< @brief Jobs queued at the start of each slice, summed
+	double sumWait;		///< @brief Seconds from queueing to the first slice, summed over jobs
+	double maxWait;		///< @brief Longest time from queueing to the first slice
+	double sumLatency;	///< @brief Seconds from queueing to </DOC>, summed over jobs
+	double maxLatency;	///< @brief Longest time from queueing to </DOC>
+
+	/// @param d The compiled automaton, start is state 0
+	/// @param spam Index of isSpam
+	/// @param skip Index of skipDoc
+	/// @param from Where to jump from each state when a scan limit is reached
+	/// @param q Most bytes scanned per slice
+	scheduler(const DFAtable &d, int spam, int skip, const vector<int> &from, long q)
+		: dfa(d), spamState(spam), skipState(skip), skipFrom(from){
+		turn = 0;
+		clock = 0;
+		quantum = q;
+		aging = largeSize = 0;
+		keepResults = false;
+		batchSize = 64;
+		slices = jobs = batches = 0;
+		maxDepth = 0;
+		sumDepth = sumWait = maxWait = sumLatency = maxLatency = 0;
+	}
+
+	~scheduler(){
+		for(size_t i = 0; i < idle.size(); ++i)
+			delete idle[i];
+		for(int i = 0; i < 2; ++i)
+			for(queue::iterator j = pools[i].begin(); j != pools[i].end(); ++j)
+				delete j->second.scan;
+	}
+
+	/// @brief Queues a message
+	/// @param p Start of the message
+	/// @param end One past the end of the message
+	/// @param offset Offset of the message in the input
+	/// @param tag Caller's name for the job
+	void submit(const char* p, const char* end, long offset, long tag = 0){
+		job j;
+		j.tag = tag;
+		j.p = p;
+		j.end = end;
+		j.offset = offset;
+		j.size = end - p;
+		j.scan = NULL;
+		j.submitted = now();
+		enqueue(j);
+	}
+
+	/// @brief A scanner from the pool, or a new one if the pool is empty
+	scanner* take(){
+		if(idle.empty())
+			return new scanner(dfa, spamState, skipState, skipFrom);
+		scanner* scan = idle.back();
+		idle.pop_back();
+		return scan;
+	}
+
+	/// @brief Returns a scanner to the pool
+	void give(scanner* scan){
+		idle.push_back(scan);
+	}
+
+	/// @brief Number of jobs queued
+	size_t depth() const{
+		return pools[0].size() + pools[1].size();
+	}
+
+	/// @brief Runs the next slice, if any job is queued
+	/// @return false if a byte had no transition, ending the job early
+	bool step(){
+		if(pools[0].empty() and pools[1].empty())
+			return true;
+		size_t queued = depth();
+		maxDepth = std::max(maxDepth, queued);
+		sumDepth += queued;
+
+		if(pools[turn].empty())
+			turn = !turn;
+		queue &pool = pools[turn];
+		job j = pool.begin()->second;
+		pool.erase(pool.begin());
+		turn = !turn;
+
+		//the job after this one, and for a resumed job the row its scan resumes in, load while this one is scanned
+		if(prefetchDistance > 0){
+			queue &after = pools[turn].empty() ? pool : pools[turn];
+			if(!after.empty()){
+				const job &n = after.begin()->second;
+				__builtin_prefetch(n.p);
+				if(n.scan != NULL and n.scan->state > 0)
+					dfa.prefetch(n.scan->state, *n.p);
+			}
+		}
+
+		//short messages at the front of the queue are scanned together, whole
+		if(j.scan == NULL and j.size <= quantum and batchSize > 1){
+			vector<job> batch(1, j);
+			while(batch.size() < batchSize and !pool.empty() and pool.begin()->second.scan == NULL
+					and pool.begin()->second.size <= quantum){
+				batch.push_back(pool.begin()->second);
+				pool.erase(pool.begin());
+			}
+			return runBatch(batch);
+		}
+
+		if(j.scan == NULL){
+			double wait = now() - j.submitted;
+			sumWait += wait;
+			maxWait = std::max(maxWait, wait);
+			j.scan = take();
+			j.scan->restart(j.offset);
+		}
+		const char* stop = j.end - j.p > quantum ? j.p + quantum : j.end;
+		long ended = docsEnded;
+		++slices;
+		bool ok = j.scan->feed(j.p, stop);
+		clock += stop - j.p;
+		j.p = stop;
+		if(ok and j.p < j.end){
+			enqueue(j);
+			return true;
+		}
+		if(ok){
+			j.scan->finish();
+			idle.push_back(j.scan);
+		}else{
+			delete j.scan;
+		}
+		++jobs;
+		double latency = now() - j.submitted;
+		sumLatency += latency;
+		maxLatency = std::max(maxLatency, latency);
+		if(keepResults){
+			result r;
+			r.tag = j.tag;
+			r.ended = ok and docsEnded != ended;
+			r.outcome = lastVerdict;
+			finished.push_back(r);
+		}
+		return ok;
+	}
+
+	/// @brief Runs short jobs whole, as one batch through one scanner
+	/// @return false if a byte had no transition
+	bool runBatch(const vector<job> &batch){
+		double started = now();
+		scanner* scan = take();
+		items.resize(batch.size());
+		for(size_t i = 0; i < batch.size(); ++i){
+			items[i].p = batch[i].p;
+			items[i].end = batch[i].end;
+			items[i].offset = batch[i].offset;
+			clock += batch[i].size;
+		}
+		bool ok = scan->scanBatch(&items[0], items.size());
+		double done = now();
+		idle.push_back(scan);
+		++slices;
+		++batches;
+		for(size_t i = 0; i < batch.size(); ++i){
+			double wait = started - batch[i].submitted, latency = done - batch[i].submitted;
+			sumWait += wait;
+			maxWait = std::max(maxWait, wait);
+			sumLatency += latency;
+			maxLatency = std::max(maxLatency, latency);
+			++jobs;
+			if(keepResults){
+				result r;
+				r.tag = batch[i].tag;
+				r.ended = items[i].ended;
+				r.outcome = items[i].outcome;
+				finished.push_back(r);
+			}
+		}
+		return ok;
+	}
+
+	/// @brief Runs slices until every queued message is decided
+	/// @return false if a byte had no transition
+	bool run(){
+		while(depth() > 0)
+			if(!step())
+				return false;
+		return true;
+	}
+
+	/// @brief Prints the queue metrics, to standard error unless given a stream
+	void printStats(ostream &out = cerr) const{
+		out << "scheduler: " << jobs << " messages in " << slices << " slices";
+		if(quantum < LONG_MAX)
+			out << " of up to " << quantum << " bytes";
+		if(batches > 0)
+			out << ", " << batches << " of them batches of short messages";
+		out << endl;
+		if(slices > 0)
+			out << "queue depth: mean " << sumDepth / slices << ", max " << maxDepth << endl;
+		if(jobs > 0)
+			out << "wait: mean " << sumWait / jobs * 1e3 << " ms, max " << maxWait * 1e3 << " ms; latency: mean "
+				<< sumLatency / jobs * 1e3 << " ms, max " << maxLatency * 1e3 << " ms" << endl;
+	}
+};
+
+/// @brief Set by SIGINT and SIGTERM to stop the service
+volatile sig_atomic_t stopService = 0;
+
+/// @brief Signal handler asking the service to stop
+void requestStop(int){
+	stopService = 1;
+}
+
+/// @brief Has SIGINT and SIGTERM stop the service, interrupting the call waiting for work
+void catchStop(){
+	struct sigaction stop;
+	memset(&stop, 0, sizeof(stop));
+	stop.sa_handler = requestStop;
+	sigaction(SIGINT, &stop, NULL);
+	sigaction(SIGTERM, &stop, NULL);
+}
+
+/// @brief Header at the start of a shared memory ring, followed by dataSize bytes of
+/// submissions and then slots completion entries. Head and tail counters only grow,
+/// positions are taken modulo the size of their area.
+struct ringHeader{
+	uint64_t submitHead;	///< @brief Submission bytes written, advanced by the client
+	uint64_t submitTail;	///< @brief Submission bytes the service is done with, advanced by the service
+	uint64_t completeHead;	///< @brief Completions written, advanced by the service
+	uint64_t completeTail;	///< @brief Completions read, advanced by the client
+	uint32_t dataSize;		///< @brief Bytes of the submission area, a multiple of 8
+	uint32_t slots;			///< @brief Entries of the completion area
+};
+
+/// @brief A verdict in the completion area of a shared memory ring
+struct ringCompletion{
+	uint64_t number;	///< @brief Number of the message on the ring, counting from 1
+	uint32_t outcome;	///< @brief One of the RING_ outcomes
+	uint32_t unused;
+};
+
+/// @brief Values of ringCompletion::outcome
+enum{ RING_SPAM = 1, RING_HAM, RING_UNDECIDED, RING_BUSY, RING_ERROR };
+
+/// @brief Submission record length marking the rest of the area unused, the next record starts at offset 0
+const uint32_t RING_WRAP = 0xFFFFFFFF;
+
+/// @brief The service end of a shared memory ring.
+/// The client writes each message into the submission area as a 4 byte length and the
+/// message bytes, padded to 8, bumps submitHead and writes submitFd (an eventfd). The
+/// service scans messages in place, so their area is only handed back by submitTail once
+/// they are decided, and writes their verdicts into the completion area, signalling completeFd.
+class sharedRing{
+	map<uint64_t, std::pair<uint64_t, bool> > inFlight;	///< @brief End and done flag of each record not handed back, by start
+	list<ringCompletion> backlog;		///< @brief Completions waiting for room in the completion area
+	uint64_t tail;						///< @brief submitTail as last stored, the client may overwrite the shared one
+
+public:
+	ringHeader* header;
+	char* data;						///< @brief The submission area
+	ringCompletion* completions;	///< @brief The completion area
+	uint32_t dataSize, slots;		///< @brief The sizes in the header, kept where the client can not change them
+	size_t bytes;					///< @brief Size of the whole mapping
+	int memFd, submitFd, completeFd;
+	uint64_t parsed;				///< @brief Submission bytes queued so far
+	uint64_t written;				///< @brief Completions written so far
+	uint64_t received;				///< @brief Messages read so far
+
+	sharedRing(){
+		header = NULL;
+		memFd = submitFd = completeFd = -1;
+		parsed = written = received = tail = 0;
+	}
+
+	~sharedRing(){
+		if(header != NULL)
+			munmap(header, bytes);
+		if(memFd >= 0) close(memFd);
+		if(submitFd >= 0) close(submitFd);
+		if(completeFd >= 0) close(completeFd);
+	}
+
+	/// @brief Creates the shared memory and the eventfds
+	/// @param size Bytes of the submission area, rounded up to 8
+	/// @return false if the system calls failed
+	bool create(size_t size){
+		dataSize = (size + 7) & ~size_t(7);
+		slots = std::max<size_t>(64, dataSize / 256);
+		bytes = sizeof(ringHeader) + dataSize + slots * sizeof(ringCompletion);
+		memFd = memfd_create("spamdetector-ring", MFD_CLOEXEC);
+		if(memFd < 0 or ftruncate(memFd, bytes) < 0)
+			return false;
+		void* m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+		if(m == MAP_FAILED)
+			return false;
+		header = (ringHeader*)m;
+		header->dataSize = dataSize;
+		header->slots = slots;
+		data = (char*)(header + 1);
+		completions = (ringCompletion*)(data + dataSize);
+		submitFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		completeFd = eventfd(0, EFD_CLOEXEC);
+		return submitFd >= 0 and completeFd >= 0;
+	}
+
+	/// @brief Finds the next message submitted
+	/// @param p Set to the message
+	/// @param length Set to its length
+	/// @param start Set to its position, for release()
+	/// @return 1 if a message was found, 0 if there is none, -1 if the ring is corrupt
+	int next(const char* &p, uint32_t &length, uint64_t &start){
+		//a head behind the records taken, or further ahead than the area holds, is not to be trusted
+		uint64_t head = __atomic_load_n(&header->submitHead, __ATOMIC_ACQUIRE);
+		if(head < parsed or head - tail > dataSize)
+			return -1;
+		while(parsed + 4 <= head){
+			size_t at = parsed % dataSize;
+			memcpy(&length, data + at, 4);
+			if(length == RING_WRAP){
+				inFlight[parsed] = std::make_pair(parsed + dataSize - at, true);
+				parsed += dataSize - at;
+				continue;
+			}
+			if(length > dataSize - at - 8)
+				return -1;
+			//a record whose bytes are not all published yet is left for a later wakeup
+			if(parsed + 8 + ((length + 7) & ~uint32_t(7)) > head)
+				break;
+			start = parsed;
+			p = data + at + 8;
+			parsed += 8 + ((length + 7) & ~uint32_t(7));
+			inFlight[start] = std::make_pair(parsed, false);
+			++received;
+			return 1;
+		}
+		handBack();
+		return 0;
+	}
+
+	/// @brief Hands the area of a decided message back to the client
+	/// @param start Position of the message given by next()
+	void release(uint64_t start){
+		inFlight[start].second = true;
+		handBack();
+	}
+
+	/// @brief Moves submitTail past the records at the front which are done with
+	void handBack(){
+		uint64_t end = 0;
+		while(!inFlight.empty() and inFlight.begin()->second.second){
+			end = inFlight.begin()->second.first;
+			inFlight.erase(inFlight.begin());
+		}
+		if(end > 0){
+			tail = end;
+			__atomic_store_n(&header->submitTail, tail, __ATOMIC_RELEASE);
+		}
+	}
+
+	/// @brief Queues the verdict of a message, written by flush()
+	void complete(uint64_t number, uint32_t outcome){
+		ringCompletion c;
+		c.number = number;
+		c.outcome = outcome;
+		c.unused = 0;
+		backlog.push_back(c);
+	}
+
+	/// @brief Writes the queued verdicts that fit in the completion area and wakes the client
+	void flush(){
+		uint64_t read = __atomic_load_n(&header->completeTail, __ATOMIC_ACQUIRE);
+		bool any = false;
+		while(!backlog.empty() and written - read < slots){
+			completions[written % slots] = backlog.front();
+			backlog.pop_front();
+			++written;
+			any = true;
+		}
+		if(any){
+			__atomic_store_n(&header->completeHead, written, __ATOMIC_RELEASE);
+			uint64_t one = 1;
+			if(write(completeFd, &one, sizeof(one)) < 0){}
+		}
+	}
+
+	/// @brief Are verdicts waiting for the client to make room
+	bool blocked() const{ return !backlog.empty(); }
+};
+
+/// @brief Scans messages sent over a Unix socket, answering each with its verdict.
+/// Clients write <DOC> records and read back one line per message, "N spam", "N ham",
+/// "N undecided" or "N busy", N counting the messages of the connection from 1.
+/// Each connection is greeted with "credit C": the service stops reading from a
+/// connection while C of its messages are unanswered, so a fast client is held back
+/// by its socket buffer rather than by a growing queue. Once highWater messages are
+/// queued, further messages are answered "busy" straight away, until the queue drains
+/// to lowWater, so the sender can fall back instead of waiting on a timeout.
+///
+/// A client on the same host may instead send "shm N" as its first line. It is answered
+/// "ring N S" carrying the memfd of a sharedRing with N submission bytes and S completion
+/// entries, its submission eventfd and its completion eventfd, and from then on submits
+/// messages through the ring, where they are scanned without being copied.
+///
+/// A client may also send "stream" as its first line, then any stream of <DOC> records in
+/// chunks of any size, as they arrive from the network. The connection gets a scanner of its
+/// own, fed each chunk as it is read, so a message split across chunks is matched as if it
+/// were read whole; each message is answered "ID verdict" with the number of its DOCID as
+/// soon as its </DOC> is scanned, and a message left open is decided when the client closes.
+///
+/// The connections are served from one thread by an epoll reactor, level triggered, each fd
+/// registered once and changed only when the events it waits for change.
+class service{
+	/// @brief A client connection
+	struct client{
+		string in;			///< @brief Bytes read which do not end a message yet
+		size_t searched;	///< @brief Bytes of in already searched for </DOC>
+		bool discarding;	///< @brief Reading past a message turned away for its size, to its </DOC>
+		string out;			///< @brief Answers not written yet
+		long received;		///< @brief Messages read from the connection
+		long outstanding;	///< @brief Messages queued and not answered yet
+		bool closing;		///< @brief The client has closed its end, close once it is answered
+		bool dead;			///< @brief The connection failed, close once its queued messages are done
+		sharedRing* ring;	///< @brief Its shared memory ring, if it asked for one
+		bool sendRing;		///< @brief The ring is made but not sent yet
+		scanner* stream;	///< @brief Its scanner, if it streams records to be scanned as they arrive
+		int watching;		///< @brief Events the reactor waits for on the connection, -1 if it is not registered
+		int ringWatching;	///< @brief Events it waits for on the ring's submission eventfd, -1 if it is not registered
+	};
+
+	/// @brief A queued message
+	struct request{
+		string* text;		///< @brief The message read from the socket, scanned in place, NULL for a ring
+		int fd;				///< @brief Connection that sent it
+		long number;		///< @brief Its number on the connection or ring
+		uint64_t start;		///< @brief Its position in the ring
+	};
+
+	scheduler &jobs;
+	int listener;
+	int poller;						///< @brief The epoll instance, made by loop()
+	map<int, client> clients;
+	map<long, request> requests;	///< @brief Queued messages by scheduler tag
+	long nextTag;
+	bool shedding;					///< @brief Answering busy until the queue drains to lowWater
+
+	/// @brief Queues an answer to a client
+	void answer(client &c, long number, const char* what){
+		if(c.dead)
+			return;
+		stringstream ss;
+		ss << number << ' ' << what << '\n';
+		c.out += ss.str();
+	}
+
+	/// @brief Should a new message be turned away
+	bool full(){
+		if(jobs.depth() >= highWater)
+			shedding = true;
+		return shedding;
+	}
+
+	/// @brief Queues the whole messages read from a client, or turns them away,
+	/// leaving those past the credit of the connection until it has answers back.
+	/// A message growing past maxMessage before its </DOC> is answered busy and
+	/// its bytes dropped as they arrive, so it is never buffered whole.
+	void admit(int fd, client &c){
+		size_t from = 0;
+		while(c.outstanding < credit or c.discarding){
+			//the search resumes where the last one gave up, less a partly read tag
+			size_t end = c.in.find("</DOC>", std::max(from, c.searched));
+			if(end == string::npos){
+				if(!c.discarding and c.in.size() - from > (size_t)maxMessage){
+					++rejected;
+					answer(c, ++c.received, "busy");
+					c.discarding = true;
+				}
+				if(c.discarding)
+					from = std::max(from, c.in.size() - std::min(c.in.size(), (size_t)5));
+				c.searched = c.in.size() - std::min(c.in.size(), (size_t)5);
+				break;
+			}
+			end += 6;
+			if(c.discarding){
+				c.discarding = false;
+				from = end;
+				continue;
+			}
+			long number = ++c.received;
+			if(full()){
+				++rejected;
+				answer(c, number, "busy");
+			}else{
+				request r;
+				r.text = new string(c.in, from, end - from);
+				r.fd = fd;
+				r.number = number;
+				requests[nextTag] = r;
+				jobs.submit(r.text->data(), r.text->data() + r.text->size(), 0, nextTag++);
+				++c.outstanding;
+				++admitted;
+			}
+			from = end;
+		}
+		c.in.erase(0, from);
+		c.searched = c.searched > from ? c.searched - from : 0;
+	}
+
+	/// @brief Queues the messages submitted to a client's ring, or turns them away,
+	/// at most ringBatch of them before the other connections get their turn
+	void admitRing(int fd, client &c){
+		uint64_t count;
+		if(read(c.ring->submitFd, &count, sizeof(count)) < 0 and errno != EAGAIN)
+			c.dead = true;
+		//no more submissions are taken while verdicts wait for the client to read the completion area,
+		//so a client that does not read them can not pile them up; it writes submitFd once it has room
+		c.ring->flush();
+		if(c.ring->blocked())
+			return;
+		const char* p;
+		uint32_t length;
+		uint64_t start;
+		int found = 0;
+		for(int taken = 0; taken < ringBatch and (found = c.ring->next(p, length, start)) > 0; ++taken){
+			if(full()){
+				++rejected;
+				c.ring->complete(c.ring->received, RING_BUSY);
+				c.ring->release(start);
+			}else{
+				request r;
+				r.text = NULL;
+				r.fd = fd;
+				r.number = c.ring->received;
+				r.start = start;
+				requests[nextTag] = r;
+				jobs.submit(p, p + length, 0, nextTag++);
+				++c.outstanding;
+				++admitted;
+			}
+		}
+		if(found < 0)
+			c.dead = true;
+		c.ring->flush();
+		//records left for the next turn, the eventfd is signalled again so the reactor comes back to them
+		if(found > 0 and !c.ring->blocked()){
+			uint64_t one = 1;
+			if(write(c.ring->submitFd, &one, sizeof(one)) < 0){}
+		}
+	}
+
+	/// @brief Answers the messages the scheduler has finished
+	void deliver(){
+		vector<sharedRing*> touched;
+		while(!jobs.finished.empty()){
+			scheduler::result r = jobs.finished.front();
+			jobs.finished.pop_front();
+			map<long, request>::iterator q = requests.find(r.tag);
+			client &c = clients[q->second.fd];
+			--c.outstanding;
+			if(q->second.text == NULL){
+				c.ring->complete(q->second.number, !r.ended ? RING_ERROR
+					: r.outcome == SPAM ? RING_SPAM : r.outcome == NOT_SPAM ? RING_HAM : RING_UNDECIDED);
+				c.ring->release(q->second.start);
+				if(std::find(touched.begin(), touched.end(), c.ring) == touched.end())
+					touched.push_back(c.ring);
+			}else{
+				answer(c, q->second.number,
+					!r.ended ? "error" : r.outcome == SPAM ? "spam" : r.outcome == NOT_SPAM ? "ham" : "undecided");
+				admit(q->second.fd, c);
+			}
+			delete q->second.text;
+			requests.erase(q);
+			++answered;
+		}
+		for(size_t i = 0; i < touched.size(); ++i)
+			touched[i]->flush();
+		//the verdicts are only reported to the clients
+		spamMessages.clear();
+		undecidedMessages.clear();
+	}
+
+	/// @brief Scans the bytes a streaming client has sent, answering the messages they end
+	void feedStream(client &c, const char* p, const char* end){
+		vector<endedDoc> ended;
+		endedMessages = &ended;
+		if(!c.stream->feed(p, end)){
+			answer(c, 0, "error");
+			c.closing = true;
+		}
+		if(c.closing)
+			c.stream->finish();
+		endedMessages = NULL;
+		for(size_t i = 0; i < ended.size(); ++i){
+			answer(c, ended[i].id, ended[i].outcome == SPAM ? "spam" : ended[i].outcome == NOT_SPAM ? "ham" : "undecided");
+			++answered;
+		}
+	}
+
+	/// @brief Registers an fd with the reactor or changes the events it waits for
+	/// @param fd The connection, or the submission eventfd of its ring
+	/// @param conn The connection the fd belongs to
+	/// @param events Events to wait for, -1 to stop watching the fd
+	/// @param watching Events registered so far, -1 if none, updated
+	void watch(int fd, int conn, int events, int &watching){
+		if(events == watching)
+			return;
+		epoll_event e;
+		memset(&e, 0, sizeof(e));
+		e.events = events < 0 ? 0 : events;
+		e.data.u64 = (uint64_t)conn << 1 | (fd != conn);
+		epoll_ctl(poller, watching < 0 ? EPOLL_CTL_ADD : events < 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &e);
+		watching = events;
+	}
+
+	/// @brief Reads what a client has sent
+	/// @return false once the connection is to be closed
+	bool readFrom(int fd, client &c){
+		char buf[65536];
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if(n < 0)
+			return errno == EAGAIN or errno == EINTR;
+		if(n == 0){
+			c.closing = true;
+			if(c.stream != NULL)
+				feedStream(c, buf, buf);
+			return true;
+		}
+		if(c.stream != NULL){
+			feedStream(c, buf, buf + n);
+			return true;
+		}
+		//a ring client submits through its ring, anything else it writes to the socket is dropped
+		if(c.ring != NULL)
+			return true;
+		c.in.append(buf, n);
+
+		//a first line "stats" asks for the queue and service metrics so far, then the connection is closed
+		if(c.received == 0 and c.in.compare(0, 6, "stats\n") == 0){
+			stringstream ss;
+			jobs.printStats(ss);
+			printStats(ss);
+			c.out += ss.str();
+			c.in.clear();
+			c.closing = true;
+			return true;
+		}
+
+		//a first line "stream" asks for a scanner of the connection's own, fed as bytes arrive
+		if(c.received == 0 and c.ring == NULL and c.in.compare(0, 7, "stream\n") == 0){
+			c.stream = jobs.take();
+			c.stream->restart(0);
+			feedStream(c, c.in.data() + 7, c.in.data() + c.in.size());
+			c.in.clear();
+			return true;
+		}
+
+		//a first line "shm N" asks for a shared memory ring of N bytes
+		size_t eol = c.in.find('\n');
+		if(c.received == 0 and c.ring == NULL and c.in.compare(0, 4, "shm ") == 0 and eol != string::npos){
+			c.ring = new sharedRing;
+			long size = atol(c.in.c_str() + 4);
+			c.in.erase(0, eol + 1);
+			if(size <= 0 or size > maxRingSize or !c.ring->create(size)){
+				answer(c, 0, "error");
+				delete c.ring;
+				c.ring = NULL;
+			}else{
+				c.sendRing = true;
+				c.in.clear();
+			}
+		}
+		if(c.ring == NULL)
+			admit(fd, c);
+		return true;
+	}
+
+	/// @brief Writes pending answers to a client, then the ring it asked for
+	/// @return false once the connection is to be closed
+	bool writeTo(int fd, client &c){
+		if(!c.out.empty()){
+			ssize_t n = send(fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+			if(n < 0)
+				return errno == EAGAIN or errno == EINTR;
+			c.out.erase(0, n);
+		}
+		if(c.out.empty() and c.sendRing){
+			stringstream ss;
+			ss << "ring " << c.ring->dataSize << ' ' << c.ring->slots << '\n';
+			string line = ss.str();
+			int fds[3] = {c.ring->memFd, c.ring->submitFd, c.ring->completeFd};
+			char control[CMSG_SPACE(sizeof(fds))];
+			memset(control, 0, sizeof(control));
+			iovec iov = {(void*)line.data(), line.size()};
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+			memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+			if(sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+				return errno == EAGAIN or errno == EINTR;
+			c.sendRing = false;
+		}
+		return true;
+	}
+
+public:
+	size_t highWater;	///< @brief Queued messages at which new ones are answered busy
+	size_t lowWater;	///< @brief Queued messages at which new ones are taken again
+	long credit;		///< @brief Most unanswered messages per connection before it is no longer read
+	long maxRingSize;	///< @brief Largest submission area a client may ask for
+	long maxMessage;	///< @brief Largest message buffered from a socket, longer ones are answered busy
+	int slicesPerPoll;	///< @brief Slices run between checks of the sockets
+	int ringBatch;		///< @brief Most ring records queued per wakeup of a ring
+
+	long admitted;		///< @brief Messages queued
+	long rejected;		///< @brief Messages answered busy
+	long answered;		///< @brief Messages answered with a verdict
+	long connections;	///< @brief Connections accepted
+
+	/// @param s Scheduler running the queued messages, its results are kept
+	service(scheduler &s) : jobs(s){
+		jobs.keepResults = true;
+		listener = -1;
+		nextTag = 0;
+		shedding = false;
+		highWater = 1024;
+		lowWater = 512;
+		credit = 64;
+		maxRingSize = 1 << 30;
+		maxMessage = 16 << 20;
+		slicesPerPoll = 16;
+		ringBatch = 256;
+		admitted = rejected = answered = connections = 0;
+	}
+
+	/// @brief Opens the listening socket
+	/// @param path File name of the socket, replaced if it exists
+	/// @return false if it could not be opened
+	bool listenOn(const char* path){
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(path) >= sizeof(addr.sun_path)){
+			cerr << "Error: socket path too long: " << path << endl;
+			return false;
+		}
+		strcpy(addr.sun_path, path);
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(path);
+		if(listener < 0 or bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 or listen(listener, 128) < 0){
+			cerr << "Error: can not listen on " << path << ": " << strerror(errno) << endl;
+			return false;
+		}
+		fcntl(listener, F_SETFL, O_NONBLOCK);
+		return true;
+	}
+
+	/// @brief Serves clients on the listening socket until SIGINT or SIGTERM
+	void loop(){
+		catchStop();
+		poller = epoll_create1(0);
+		int listening = -1;
+		watch(listener, listener, EPOLLIN, listening);
+		epoll_event events[256];
+		while(!stopService){
+			//a ring whose completion area is full is retried shortly, the client frees it without a wakeup
+			bool blocked = false;
+			for(map<int, client>::iterator c = clients.begin(); c != clients.end(); ++c)
+				blocked = blocked or (c->second.ring != NULL and c->second.ring->blocked());
+			int n = epoll_wait(poller, events, sizeof(events) / sizeof(*events), jobs.depth() > 0 ? 0 : blocked ? 1 : -1);
+			if(n < 0 and errno != EINTR){
+				cerr << "Error: epoll_wait: " << strerror(errno) << endl;
+				break;
+			}
+
+			for(int i = 0; i < n; ++i){
+				int fd = events[i].data.u64 >> 1;
+				if(fd == listener){
+					while((fd = accept(listener, NULL, NULL)) >= 0){
+						fcntl(fd, F_SETFL, O_NONBLOCK);
+						client &c = clients[fd];
+						c.received = c.outstanding = 0;
+						c.searched = 0;
+						c.discarding = false;
+						c.closing = c.dead = c.sendRing = false;
+						c.ring = NULL;
+						c.stream = NULL;
+						c.watching = c.ringWatching = -1;
+						stringstream ss;
+						ss << "credit " << credit << '\n';
+						c.out = ss.str();
+						++connections;
+					}
+					continue;
+				}
+				map<int, client>::iterator k = clients.find(fd);
+				if(k == clients.end() or k->second.dead)
+					continue;
+				client &c = k->second;
+				if(events[i].data.u64 & 1){
+					admitRing(fd, c);
+					continue;
+				}
+				bool open = true;
+				if(events[i].events & (EPOLLIN | EPOLLHUP))
+					open = readFrom(fd, c);
+				if(open and (events[i].events & EPOLLOUT))
+					open = writeTo(fd, c);
+				if(!open or (events[i].events & EPOLLERR))
+					c.dead = true;
+			}
+
+			for(int i = 0; i < slicesPerPoll and jobs.depth() > 0; ++i)
+				jobs.step();
+			deliver();
+			if(shedding and jobs.depth() <= lowWater)
+				shedding = false;
+
+			//close connections once nothing of theirs is queued, keeping the fd (and ring) until then,
+			//and wait for reads while a connection has credit (a streaming one, while its answers are taken)
+			//and for writes while it has answers to send
+			for(map<int, client>::iterator c = clients.begin(); c != clients.end(); ){
+				client &k = c->second;
+				if(k.ring != NULL and !k.dead)
+					k.ring->flush();
+				bool done = k.closing and k.out.empty() and !k.sendRing;
+				if(k.outstanding == 0 and (k.dead or done)){
+					//the client holds the ring's eventfd too, so it stays registered unless removed
+					watch(c->first, c->first, -1, k.watching);
+					if(k.ring != NULL)
+						watch(k.ring->submitFd, c->first, -1, k.ringWatching);
+					close(c->first);
+					delete k.ring;
+					if(k.stream != NULL)
+						jobs.give(k.stream);
+					clients.erase(c++);
+					continue;
+				}
+				int want = -1;
+				if(!k.dead){
+					want = 0;
+					if(!k.closing and (k.stream != NULL ? k.out.size() < 65536 : k.outstanding < credit))
+						want |= EPOLLIN;
+					if(!k.out.empty() or k.sendRing)
+						want |= EPOLLOUT;
+				}
+				watch(c->first, c->first, want, k.watching);
+				if(k.ring != NULL)
+					watch(k.ring->submitFd, c->first, k.dead ? -1 : (int)EPOLLIN, k.ringWatching);
+				++c;
+			}
+		}
+
+		for(map<int, client>::iterator c = clients.begin(); c != clients.end(); ++c){
+			close(c->first);
+			delete c->second.ring;
+			delete c->second.stream;
+		}
+		clients.clear();
+		close(poller);
+	}
+
+	/// @brief Serves clients on a Unix socket until SIGINT or SIGTERM
+	/// @param path File name of the socket, replaced if it exists
+	/// @return Unix exit code, 0 for success
+	int serve(const char* path){
+		if(!listenOn(path))
+			return -1;
+		loop();
+		close(listener);
+		unlink(path);
+		return 0;
+	}
+
+	/// @brief Serves clients on a Unix socket from several worker processes until SIGINT or SIGTERM.
+	/// The automaton is built once, before the fork, so the workers share its pages copy on write;
+	/// they all accept on the one listening socket, and a worker that dies is replaced.
+	/// @param path File name of the socket, replaced if it exists
+	/// @param workers Number of worker processes
+	/// @param stats Have each worker print its metrics as it stops
+	/// @return Unix exit code, 0 for success
+	int prefork(const char* path, int workers, bool stats){
+		if(!listenOn(path))
+			return -1;
+		catchStop();
+		map<pid_t, double> started;
+		while(!stopService){
+			if((int)started.size() < workers){
+				pid_t pid = fork();
+				if(pid == 0){
+					loop();
+					if(stats){
+						cerr << "worker " << getpid() << ": ";
+						jobs.printStats();
+						printStats();
+					}
+					_exit(0);
+				}
+				if(pid < 0){
+					cerr << "Error: fork: " << strerror(errno) << endl;
+					break;
+				}
+				started[pid] = now();
+				continue;
+			}
+			int status;
+			pid_t pid = waitpid(-1, &status, 0);
+			if(pid <= 0)
+				continue;
+			double lived = now() - started[pid];
+			started.erase(pid);
+			if(!stopService){
+				cerr << "worker " << pid << " stopped (status " << status << "), starting another" << endl;
+				//do not spin on a worker that fails as soon as it starts
+				if(lived < 1)
+					sleep(1);
+			}
+		}
+		for(map<pid_t, double>::iterator w = started.begin(); w != started.end(); ++w)
+			kill(w->first, SIGTERM);
+		while(wait(NULL) > 0);
+		close(listener);
+		unlink(path);
+		return 0;
+	}
+
+	/// @brief Prints the service metrics, to standard error unless given a stream
+	void printStats(ostream &out = cerr) const{
+		out << "service: " << connections << " connections, " << admitted << " messages queued, "
+			<< answered << " answered, " << rejected << " rejected busy" << endl;
+	}
+};
+
+/// @brief One position of the Levenshtein automaton of a single keyword
+struct keywordItem{
+	int kw;		///< @brief Index of the keyword in keywords
+	int pos;	///< @brief Number of keyword characters matched so far
+	int edits;	///< @brief Edits spent reaching pos
+
+	/// @brief Builds an item from its defining parameters
+	keywordItem(int k, int p, int e){ kw = k; pos = p; edits = e; }
+
+	/// @brief Orders items by keyword and position, cheapest first, so sets of items can be compared
+	bool operator<(const keywordItem &o) const{
+		if(kw != o.kw) return kw < o.kw;
+		if(pos != o.pos) return pos < o.pos;
+		return edits < o.edits;
+	}
+	bool operator==(const keywordItem &o) const{
+		return kw == o.kw and pos == o.pos and edits == o.edits;
+	}
+};
+
+/// @brief A state of the merged keyword automata, all items that are still alive
+typedef vector<keywordItem> itemSet;
+
+/// @brief Builds the deterministic keyword matching states leading out of the delimited state.
+/// Each keyword is treated as a Levenshtein automaton (an exact chain when its fuzz is 0)
+/// and all of them are merged by subset construction, so fuzzy and exact keywords are
+/// matched by the same single pass.
+class keywordCompiler{
+	map<itemSet, DFAstate*> built;	///< @brief DFA state for every item set reached so far
+	list<itemSet> pending;			///< @brief Item sets whose outgoing transitions are not wired yet
+	itemSet startSet;				///< @brief Items alive at the start of a word
+	map<vector<int>, int> acceptIndex;	///< @brief Index of each distinct set of completed keywords in acceptSets
+	DFAstate &delimited, &notdelimited, &closeDoc;
+
+	/// @brief Adds keyword character deletions and drops items beaten by a cheaper copy
+	void close(itemSet &s){
+		for(size_t i = 0; i < s.size(); ++i){
+			const keyword &k = keywords[s[i].kw];
+			if(s[i].edits < k.fuzz and s[i].pos < (int)k.text.size() and k.text[s[i].pos] != ' ')
+				s.push_back(keywordItem(s[i].kw, s[i].pos+1, s[i].edits+1));
+		}
+		std::sort(s.begin(), s.end());
+		itemSet kept;
+		for(size_t i = 0; i < s.size(); ++i)
+			if(kept.empty() or kept.back().kw != s[i].kw or kept.back().pos != s[i].pos)
+				kept.push_back(s[i]);
+		s.swap(kept);
+	}
+
+	/// @brief Items alive after reading an input symbol
+	/// @param s Items alive before the symbol
+	/// @param c The input symbol, -1 for a letter that is not the next character of any keyword
+	/// @param letter True if c is a letter, which may be substituted or inserted
+	itemSet advance(const itemSet &s, int c, bool letter){
+		itemSet next;
+		for(size_t i = 0; i < s.size(); ++i){
+			const keyword &k = keywords[s[i].kw];
+			int len = k.text.size();
+			if(c >= 0 and s[i].pos < len and (k.text[s[i].pos] == ' ' ? c == ' ' : keyChar(c, k.text[s[i].pos])))
+				next.push_back(keywordItem(s[i].kw, s[i].pos+1, s[i].edits));
+			if(letter and s[i].edits < k.fuzz){
+				if(s[i].pos < len and k.text[s[i].pos] != ' ')
+					next.push_back(keywordItem(s[i].kw, s[i].pos+1, s[i].edits+1));
+				next.push_back(keywordItem(s[i].kw, s[i].pos, s[i].edits+1));
+			}
+		}
+		if(c >= 0 and delimiters(c, 0))
+			next.insert(next.end(), startSet.begin(), startSet.end());
+		close(next);
+		return next;
+	}
 
+	/// @brief Finds the keywords fully matched in an item set
+	/// @return Index of the set of matched keywords in acceptSets, -1 if there are none
+	int accepting(const itemSet &s){
+		vector<int> found;
+		for(size_t i = 0; i < s.size(); ++i)
+			if(s[i].pos == (int)keywords[s[i].kw].text.size())
+				found.push_back(s[i].kw);
+		if(found.empty())
+			return -1;
+		map<vector<int>, int>::iterator known = acceptIndex.find(found);
+		if(known != acceptIndex.end())
+			return known->second;
+		acceptSets.push_back(found);
+		return acceptIndex[found] = acceptSets.size() - 1;
+	}
 
-/// @brief Holds a finite automata state and all it's outgoing transitions.
-class DFAstate{
-protected:
-	/// @brief Holds the definition of an outgoing transition function
-	class transitionRecord{
-	public:
-		charComparator onSymbols;///< @brief Input symbol identification trigger function.
-		DFAstate* to;			///< @brief Destination state
-		charConsumer doing;		///< @brief Optional edge action.
-		int comparedTo;			///< @brief optional value to compare input to (needed to identify single character with one function)
+	/// @brief Finds or creates the state for an item set, queueing new states for wiring
+	DFAstate *stateFor(const itemSet &s){
+		map<itemSet, DFAstate*>::iterator found = built.find(s);
+		if(found != built.end())
+			return found->second;
 
-		/// @brief Builds a new transition function from it's defining parameters
-		transitionRecord(charComparator which, DFAstate &where, charConsumer does = NULL, int what = -129){
-			onSymbols = which; to = &where; doing = does; comparedTo = what;
+		//name the state after the longest keyword prefix it has matched
+		DFAstate *state = new DFAstate;
+		const keywordItem *best = &s[0];
+		for(size_t i = 1; i < s.size(); ++i)
+			if(s[i].pos > best->pos or (s[i].pos == best->pos and s[i].edits < best->edits))
+				best = &s[i];
+		stringstream ss;
+		for(int i = 0; i < best->pos; ++i)
+			ss << (keywords[best->kw].text[i] == ' ' ? '_' : keywords[best->kw].text[i]);
+		if(best->edits > 0)
+			ss << '~' << best->edits;
+		state->name = ss.str();
+
+		built[s] = state;
+		pending.push_back(s);
+		return state;
+	}
+
+	/// @brief Adds the outgoing transitions of one keyword state
+	void wire(DFAstate &state, const itemSet &s){
+		//words are only counted for proximity terms, a leading delimiter ends one unless it follows another
+		bool inWord = !std::binary_search(s.begin(), s.end(), keywordItem(0, 0, 0));
+		charConsumer wordEnd = !nearTerms.empty() and inWord ? &nextWord : NULL;
+
+		//record completed keywords and carry on, the scan loop skips ahead once the rules settle the message
+		int found = accepting(s);
+		if(found >= 0){
+			//a keyword ending where a longer phrase goes on, as "free" in "free software", keeps the phrase alive
+			bool phrase = false;
+			for(size_t i = 0; i < s.size(); ++i)
+				phrase = phrase or (s[i].pos < (int)keywords[s[i].kw].text.size() and keywords[s[i].kw].text[s[i].pos] == ' ');
+			//a '<' given as a trailing delimiter still has to start the closing DOC tag
+			if(trailingDelimiters('<', 0))
+				state.addTransition(&justChar, closeDoc, &recordAccept, '<', found);
+			if(phrase and trailingDelimiters(' ', 0))
+				state.addTransition(&justChar, *stateFor(advance(s, ' ', false)),
+					delimiters(' ', 0) and wordEnd ? &recordAcceptWord : &recordAccept, ' ', found);
+			state.addTransition(&boundaryIs, delimited, wordEnd ? &recordAcceptWord : &recordAccept, LEADING_DELIMITER | TRAILING_DELIMITER, found);
+			state.addTransition(&trailingDelimiters, notdelimited, &recordAccept, -129, found);
 		}
-	};
 
-	/// @brief The in order list of all the state's outgoing transitions
-	vector<transitionRecord> transitions;
+		//one transition per distinct keyword character that can be read next
+		string seen;
+		for(size_t i = 0; i < s.size(); ++i){
+			const keyword &k = keywords[s[i].kw];
+			if(s[i].pos >= (int)k.text.size())
+				continue;
+			char ch = k.text[s[i].pos];
+			bool dup = false;
+			for(size_t j = 0; j < seen.size(); ++j)
+				dup = dup or (ch == ' ' ? seen[j] == ' ' : seen[j] != ' ' and keyChar(seen[j], ch));
+			if(dup)
+				continue;
+			seen += ch;
+			if(ch == ' ')
+				state.addTransition(&justChar, *stateFor(advance(s, ch, false)), delimiters(ch, 0) ? wordEnd : NULL, ch);
+			else
+				state.addTransition(&keyChar, *stateFor(advance(s, ch, true)), NULL, ch);
+		}
+
+		state.addTransition(&justChar, closeDoc, NULL, '<');
+		state.addTransition(&delimiters, delimited, wordEnd);
+		itemSet other = advance(s, -1, true);
+		if(!other.empty())
+			state.addTransition(&trailingDelimiters, notdelimited);
+		state.addTransition(&everything, *stateFor(other));
+	}
+
 public:
-	/// @brief A user-readable ID for this state.
-	string name;
+	/// @brief Sets up a compiler wiring keyword states in between the given hand built states
+	/// @param d The state at the start of a word, its transitions are added by build()
+	/// @param nd The state in the middle of a word that can not be a keyword
+	/// @param cd The first state of the closing DOC tag
+	keywordCompiler(DFAstate &d, DFAstate &nd, DFAstate &cd)
+		: delimited(d), notdelimited(nd), closeDoc(cd){
+		for(size_t i = 0; i < keywords.size(); ++i)
+			startSet.push_back(keywordItem(i, 0, 0));
+		close(startSet);
+	}
 
-	/// @builds a name for this function by concatenating an integer onto a string, for naming sequences of states.
-	/// @param newname String literal of the prefix of the name
-	///	@param suffix An integer suffix for the name
-	void iteratedname(const char* newname, int suffix){
-		stringstream ss;
-		ss << newname << suffix;
-		name = ss.str();
+	/// @brief Creates and wires all keyword states
+	/// @param maxStates Cap on the number of states created, fuzzy keywords can blow up the subset construction
+	/// @return false if the cap was exceeded
+	bool build(size_t maxStates){
+		built[itemSet()] = &notdelimited;
+		built[startSet] = &delimited;
+		pending.push_back(startSet);
+		while(!pending.empty()){
+			if(built.size() > maxStates)
+				return false;
+			itemSet s = pending.front();
+			pending.pop_front();
+			wire(*built[s], s);
+		}
+		return true;
 	}
 
-	/// @brief Adds a new outgoing transition to this state.
-	/// @note Previously defined transitions will take precedence and catch whichever characters they identify, removing those from subsequent transitions
-	/// @param which Pointer to a function that returns true if an input symbol triggers this transition
-	/// @param where Reference to the detination state of this transition.
-	/// @param does An optional pointer to an action function that is executed on this transition.  Null by default
-	/// @param what An optional value to compare input characters against if the trigger function requires it.  Invalid for that use by default.
-	void addTransition(charComparator which, DFAstate &where, charConsumer does = NULL, int what = -129){
-		transitions.push_back(*(new transitionRecord(which, where, does, what)));
+	/// @brief Number of keyword states created, including delimited and not-delimited
+	size_t size(){ return built.size(); }
+};
+
+/// @brief Minimal perfect hash of a fixed set of words (hash and displace).
+/// Every word of the set gets its own slot in 0..size()-1; any other string also lands
+/// on some slot and is rejected by comparing it to the word stored there.
+/// Words are hashed and compared through foldClass, so normalization classes apply.
+class perfectHash{
+	vector<unsigned> displacement;	///< @brief Displacement chosen for each bucket
+	vector<unsigned> offset;		///< @brief Start of each slot's word in pool
+	vector<unsigned> length;		///< @brief Length of each slot's word
+	string pool;					///< @brief All words, folded, back to back
+
+	/// @brief 64 bit FNV-1a of the folded bytes, finished with a multiply-xorshift mix
+	static unsigned long long hash(const char* s, size_t len){
+		unsigned long long h = 14695981039346656037ULL;
+		for(size_t i = 0; i < len; ++i){
+			h ^= foldClass[(unsigned char)s[i]];
+			h *= 1099511628211ULL;
+		}
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h;
 	}
 
-	/// @brief Take the outgoing transition from this state given an input symbol.
-	/// @param c An input symbol to transition with.
-	/// @return A pointer to the next state in the automaton, NULL if unhandled
-	/// @note While the structure of the automaton is nondeterministic in theory, this function interprets that structure in a strictly deterministic fashion.
-	DFAstate *transitionWithChar(char c){
-		if(transitions.empty())
-			return NULL;
-		for(vector<transitionRecord>::iterator i = transitions.begin(); i != transitions.end(); i++){
-			if(i->onSymbols(c,i->comparedTo)){
-				if(i->doing != NULL)
-					i->doing(c);
-				return i->to;
+	/// @brief Slot of a word hash for a bucket displacement
+	unsigned slot(unsigned long long h, unsigned d) const{
+		unsigned long long x = (h + d * 0x9e3779b97f4a7c15ULL) * 0xc4ceb9fe1a85ec53ULL;
+		return (unsigned)((x ^ (x >> 29)) % offset.size());
+	}
+
+public:
+	/// @brief Builds the hash for a set of distinct words
+	/// @param words The words to place, duplicates must be removed first
+	void build(const vector<string> &words){
+		size_t n = words.size();
+		size_t buckets = n / 4 + 1;
+		displacement.assign(buckets, 0);
+		offset.assign(n ? n : 1, 0);
+		length.assign(offset.size(), 0);
+		pool.clear();
+
+		//group the words by bucket, and place the largest buckets first
+		vector<vector<size_t> > members(buckets);
+		vector<unsigned long long> hashes(n);
+		for(size_t i = 0; i < n; ++i){
+			hashes[i] = hash(words[i].data(), words[i].size());
+			members[(hashes[i] >> 32) % buckets].push_back(i);
+		}
+		vector<std::pair<size_t, size_t> > order;
+		for(size_t b = 0; b < buckets; ++b)
+			order.push_back(std::make_pair(members[b].size(), b));
+		std::sort(order.rbegin(), order.rend());
+
+		vector<bool> taken(offset.size(), false);
+		for(size_t o = 0; o < order.size() and order[o].first > 0; ++o){
+			const vector<size_t> &m = members[order[o].second];
+			for(unsigned d = 0; ; ++d){
+				vector<unsigned> slots;
+				size_t i;
+				for(i = 0; i < m.size(); ++i){
+					unsigned s = slot(hashes[m[i]], d);
+					if(taken[s] or std::find(slots.begin(), slots.end(), s) != slots.end())
+						break;
+					slots.push_back(s);
+				}
+				if(i < m.size())
+					continue;
+				displacement[order[o].second] = d;
+				for(i = 0; i < m.size(); ++i){
+					taken[slots[i]] = true;
+					offset[slots[i]] = pool.size();
+					length[slots[i]] = words[m[i]].size();
+					for(size_t j = 0; j < words[m[i]].size(); ++j)
+						pool += (char)foldClass[(unsigned char)words[m[i]][j]];
+				}
+				break;
 			}
 		}
-		return NULL;
+	}
+
+	/// @brief Looks up a word
+	/// @param s Start of the word
+	/// @param len Length of the word
+	/// @return The word's slot, -1 if the word is not in the set
+	int find(const char* s, size_t len) const{
+		unsigned long long h = hash(s, len);
+		unsigned at = slot(h, displacement[(h >> 32) % displacement.size()]);
+		if(length[at] != len)
+			return -1;
+		const char* w = pool.data() + offset[at];
+		for(size_t i = 0; i < len; ++i)
+			if(foldClass[(unsigned char)s[i]] != (unsigned char)w[i])
+				return -1;
+		return at;
+	}
+
+	/// @brief Number of slots
+	size_t size() const{ return offset.size(); }
+
+	/// @brief Memory used by the hash and its words
+	size_t bytes() const{
+		return pool.size() + (displacement.size() + offset.size() + length.size()) * sizeof(unsigned);
 	}
 };
 
+/// @brief Keyword matcher working on whole words instead of characters.
+/// Message bodies are split into words at the delimiter bytes, each word is looked up in a
+/// minimal perfect hash of the keyword words.  A single word keyword is found from the
+/// word's slot alone, and phrases are matched by a small trie over the word slots, holding
+/// only the phrases of more than one word.  Memory grows with the number of keyword words
+/// rather than with the number of automaton states, which suits dictionaries of many single words.
+/// @note Words are matched exactly (after normalization), fuzzy keywords need the character automaton.
+class tokenEngine{
+	perfectHash dict;						///< @brief Slot of every distinct keyword word
+	vector<int> wordKeyword;				///< @brief Keyword made of just the word in this slot, -1 if none
+	vector<int> phraseStart;				///< @brief Trie node of the phrases starting with the word in this slot, -1 if none
+	vector<map<int, int> > phraseChildren;	///< @brief Phrase trie, from the first word of each phrase on
+	vector<int> phraseKeyword;				///< @brief Keyword ending at this trie node, -1 if none
+#ifdef __SSE2__
+	__m128i boundarySplat[8];				///< @brief Each boundary byte repeated across a vector
+	int numBoundary;						///< @brief Number of boundary bytes, more than 8 uses the scalar loop
+#endif
 
-//Globals:
-/// @brief holds a queue of spam message IDs as they are identified
-list<int> spamMessages;
+	/// @brief Finds the first word boundary byte at or after p, 16 bytes per step where SSE2 is available
+	const char* nextBoundary(const char* p, const char* end) const{
+#ifdef __SSE2__
+		if(numBoundary <= 8){
+			while(end - p >= 16){
+				__m128i v = _mm_loadu_si128((const __m128i*)p);
+				__m128i hit = _mm_setzero_si128();
+				for(int i = 0; i < numBoundary; ++i)
+					hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, boundarySplat[i]));
+				int mask = _mm_movemask_epi8(hit);
+				if(mask)
+					return p + __builtin_ctz(mask);
+				p += 16;
+			}
+		}
+#endif
+		while(p < end and !boundaryClass[(unsigned char)*p]) ++p;
+		return p;
+	}
 
-/// @brief The parsed message ID of the current message
-int currentMessageNum;
+	/// @brief Records the keywords in a message body until the rules settle the message
+	/// @param p Start of the body, the byte before it counts as a leading delimiter
+	/// @param end One past the end of the body
+	/// @param doc The <DOC> tag of the message, where budget offsets are counted from
+	void scanBody(const char* p, const char* end, const char* doc) const{
+		const char* body = p;
+		const char* nextCheck = p + budgetCheckInterval;
+		bool canStart = true;	//preceded by a leading delimiter
+		bool inWord = false;	//bytes other than leading delimiters read since the last one, counted as a word
+		vector<int> active;		//phrase nodes waiting for their next word
+		vector<int> next;
+		while(p < end){
+			if(p >= nextCheck){
+				if(outOfTime()){
+					outOfBudget(p - doc);
+					return;
+				}
+				nextCheck = p + budgetCheckInterval;
+			}
+			const char* e = nextBoundary(p, end);
+			if(e == p){
+				//a delimiter that does not end a word breaks any phrase in progress
+				active.clear();
+				canStart = delimiters(*p, 0);
+				if(canStart and inWord)
+					++docWord;
+				inWord = !canStart;
+				++p;
+				continue;
+			}
 
-/// @brief Transition action used to report a string has been accepted
-void sayAccepted(char){
-	cout << "Accepted" << endl;
+			next.clear();
+			int word = -1;
+			if(canStart or !active.empty()){
+				int id = dict.find(p, e - p);
+				map<int, int>::const_iterator c;
+				if(id >= 0){
+					if(canStart){
+						word = wordKeyword[id];
+						if(phraseStart[id] >= 0)
+							next.push_back(phraseStart[id]);
+					}
+					for(size_t i = 0; i < active.size(); ++i)
+						if((c = phraseChildren[active[i]].find(id)) != phraseChildren[active[i]].end())
+							next.push_back(c->second);
+				}
+			}
+			if(e == end)
+				return;
+			if(trailingDelimiters(*e, 0)){
+				bool found = word >= 0;
+				if(found){
+					freezeScopes(e - body);
+					foundKeyword(word);
+				}
+				for(size_t i = 0; i < next.size(); ++i){
+					if(phraseKeyword[next[i]] >= 0){
+						if(!found)
+							freezeScopes(e - body);
+						foundKeyword(phraseKeyword[next[i]]);
+						found = true;
+					}
+				}
+				if(found){
+					decide();
+					if(docVerdict != UNDECIDED)
+						return;
+				}
+			}
+
+			//a single space continues phrases, as in "free access"
+			active.clear();
+			if(*e == ' ')
+				for(size_t i = 0; i < next.size(); ++i)
+					if(!phraseChildren[next[i]].empty())
+						active.push_back(next[i]);
+			canStart = delimiters(*e, 0);
+			if(canStart)
+				++docWord;
+			inWord = !canStart;
+			p = e + 1;
+		}
+	}
+
+public:
+	/// @brief Builds the dictionary and phrase trie from the keyword list
+	void build(){
+		vector<vector<string> > phrases;
+		vector<string> words;
+		for(size_t k = 0; k < keywords.size(); ++k){
+			stringstream ss(keywords[k].text);
+			vector<string> phrase;
+			string w;
+			while(ss >> w) phrase.push_back(w);
+			phrases.push_back(phrase);
+			words.insert(words.end(), phrase.begin(), phrase.end());
+		}
+
+		//distinct words, compared after normalization
+		for(size_t i = 0; i < words.size(); ++i)
+			for(size_t j = 0; j < words[i].size(); ++j)
+				words[i][j] = foldClass[(unsigned char)words[i][j]];
+		std::sort(words.begin(), words.end());
+		words.erase(std::unique(words.begin(), words.end()), words.end());
+		dict.build(words);
+
+		//single words are looked up by slot, only phrases of several words go in the trie
+		wordKeyword.assign(dict.size(), -1);
+		phraseStart.assign(dict.size(), -1);
+		phraseChildren.clear();
+		phraseKeyword.clear();
+		for(size_t k = 0; k < phrases.size(); ++k){
+			if(phrases[k].empty())
+				continue;
+			int id = dict.find(phrases[k][0].data(), phrases[k][0].size());
+			if(phrases[k].size() == 1){
+				wordKeyword[id] = k;
+				continue;
+			}
+			if(phraseStart[id] < 0){
+				phraseStart[id] = phraseChildren.size();
+				phraseChildren.push_back(map<int, int>());
+				phraseKeyword.push_back(-1);
+			}
+			int node = phraseStart[id];
+			for(size_t i = 1; i < phrases[k].size(); ++i){
+				id = dict.find(phrases[k][i].data(), phrases[k][i].size());
+				if(phraseChildren[node].find(id) == phraseChildren[node].end()){
+					phraseChildren[node][id] = phraseChildren.size();
+					phraseChildren.push_back(map<int, int>());
+					phraseKeyword.push_back(-1);
+				}
+				node = phraseChildren[node][id];
+			}
+			phraseKeyword[node] = k;
+		}
+
+#ifdef __SSE2__
+		numBoundary = 0;
+		for(int b = 0; b < 256; ++b)
+			if(boundaryClass[b] and numBoundary++ < 8)
+				boundarySplat[numBoundary-1] = _mm_set1_epi8((char)b);
+#endif
+	}
+
+	/// @brief Finds the spam messages in a buffer of <DOC> records
+	/// @param p Start of the input
+	/// @param end One past the end of the input
+	void scan(const char* p, const char* end){
+		static const char openDoc[] = "<DOC>", openID[] = "<DOCID>", closeID[] = "</DOCID>", closeDoc[] = "</DOC>";
+		while((p = (const char*)memmem(p, end - p, openDoc, 5)) != NULL){
+			const char* doc = p;
+			p += 5;
+			while(p < end and whitespace(*p, 0)) ++p;
+			if(end - p < 7 or memcmp(p, openID, 7) != 0) continue;
+			p += 7;
+			while(p < end and whitespace(*p, 0)) ++p;
+			if(end - p < 4 or memcmp(p, "msg", 3) != 0 or !digits(p[3], 0)) continue;
+			p += 3;
+			newMsg(0, 0);
+			while(p < end and digits(*p, 0)) currentMessageNum = currentMessageNum * 10 + (*p++ - '0');
+			while(p < end and whitespace(*p, 0)) ++p;
+			if(end - p < 8 or memcmp(p, closeID, 8) != 0) continue;
+			p += 8;
+
+			//the body follows the first line holding only whitespace
+			const char* body = NULL;
+			while(body == NULL and (p = (const char*)memchr(p, '\n', end - p)) != NULL){
+				const char* q = ++p;
+				while(q < end and *q != '\n' and whitespace(*q, 0)) ++q;
+				if(q < end and *q == '\n')
+					body = q + 1;
+			}
+			if(body == NULL)
+				return;
+			const char* bodyEnd = (const char*)memmem(body, end - body, closeDoc, 6);
+			if(bodyEnd == NULL)
+				bodyEnd = end;
+			const char* limit = maxScanDepth > 0 and bodyEnd - body > maxScanDepth ? body + maxScanDepth : bodyEnd;
+			//the budget runs out unless the scan depth or the final '>' of </DOC> comes first
+			long stop = maxScanDepth > 0 and body - doc + maxScanDepth <= bodyEnd - doc + 5 ? body - doc + maxScanDepth : bodyEnd - doc + 5;
+			bool budgetCut = docByteBudget > 0 and docByteBudget <= stop;
+			if(budgetCut and docByteBudget < limit - doc)
+				limit = std::max(body, doc + docByteBudget);
+			scanBody(body, limit, doc);
+			if(budgetCut and docVerdict == UNDECIDED and !docOverBudget)
+				outOfBudget(docByteBudget);
+			endDoc(0, 0);
+			p = bodyEnd;
+		}
+	}
+
+	/// @brief Memory used by the dictionary, the per slot keywords and the phrase trie
+	size_t bytes() const{
+		//a map node holds three tree links and a color besides its pair
+		size_t edges = 0;
+		for(size_t i = 0; i < phraseChildren.size(); ++i)
+			edges += phraseChildren[i].size();
+		return dict.bytes() + (wordKeyword.size() + phraseStart.size()) * sizeof(int)
+			+ phraseChildren.size() * (sizeof(map<int, int>) + sizeof(int))
+			+ edges * (4 * sizeof(void*) + sizeof(std::pair<const int, int>));
+	}
+
+	/// @brief Prints the dictionary size to standard error
+	void printStats() const{
+		cerr << "token engine: " << dict.size() << " keyword words, " << phraseChildren.size() << " phrase nodes, "
+			<< bytes() << " bytes" << endl;
+	}
+};
+
+/// @brief Reads an input file a block at a time.
+/// By default the file is read through the page cache like any other. A scan that reads
+/// the file once, as of a large archive, can instead stream it: the kernel is asked to read
+/// ahead of the scan (POSIX_FADV_WILLNEED) and to drop the pages already scanned
+/// (POSIX_FADV_DONTNEED), so the scan does not evict the rest of the page cache.
+///
+/// Or the file can bypass the page cache altogether: it is read with O_DIRECT into a pool
+/// of aligned buffers, with a read in flight (kernel AIO) for each buffer not handed out,
+/// and each buffer is handed to the scan as it is, without a copy. The direct reads stop at
+/// the last whole block of the file and the unaligned tail is read through the page cache.
+/// A record straddling two buffers needs nothing special for the byte at a time scan, which
+/// resumes where the previous buffer left it; the scans taking whole messages get it through
+/// a recordReader, which copies just that record. Where the file system does not allow
+/// O_DIRECT, or a direct read comes back short, the rest of the file is read through the page cache.
+class inputFile{
+	int fd;
+	vector<char> block;
+	long offset;		///< @brief Bytes read so far
+	long advised;		///< @brief End of the range asked to be read ahead
+	long dropped;		///< @brief End of the range dropped from the page cache
+
+	int directFd;				///< @brief The file opened with O_DIRECT, -1 if not reading directly
+	aio_context_t aio;			///< @brief Kernel AIO context, 0 to read synchronously
+	vector<char*> pool;			///< @brief The aligned buffers
+	vector<iocb> reads;			///< @brief The read of each buffer
+	vector<long> done;			///< @brief Bytes read into each buffer, -2 while its read is in flight, -3 if idle
+	size_t head;				///< @brief Buffer holding the next bytes of the file
+	int handed;					///< @brief Buffer handed out by the last call, -1 if none
+	long submitted;				///< @brief End of the range asked to be read directly
+	long directEnd;				///< @brief End of the whole blocks of the file
+
+	/// @brief Starts reading the next range of the file into a buffer, if any is left
+	void submit(size_t i){
+		if(submitted >= directEnd){
+			done[i] = -3;
+			return;
+		}
+		iocb &r = reads[i];
+		memset(&r, 0, sizeof(r));
+		r.aio_data = i;
+		r.aio_lio_opcode = IOCB_CMD_PREAD;
+		r.aio_fildes = directFd;
+		r.aio_buf = (uint64_t)pool[i];
+		r.aio_nbytes = std::min((long)bufferSize, directEnd - submitted);
+		r.aio_offset = submitted;
+		submitted += r.aio_nbytes;
+		done[i] = -2;
+		iocb* list[1] = {&r};
+		if(aio != 0 and syscall(SYS_io_submit, aio, 1, list) == 1)
+			return;
+		ssize_t n;
+		while((n = pread(directFd, pool[i], r.aio_nbytes, r.aio_offset)) < 0 and errno == EINTR);
+		done[i] = n;
+	}
+
+	/// @brief Waits until the read into a buffer is done
+	void reap(size_t i){
+		io_event events[64];
+		while(done[i] == -2){
+			long n = syscall(SYS_io_getevents, aio, 1, 64, events, NULL);
+			if(n < 0 and errno != EINTR){
+				done[i] = -1;
+				break;
+			}
+			for(long j = 0; j < n; ++j)
+				done[events[j].data] = events[j].res;
+		}
+	}
+
+	/// @brief Stops reading directly, the rest of the file is read through the page cache from offset
+	void stopDirect(){
+		if(aio != 0){
+			//wait for the reads in flight, their buffers are freed next
+			for(size_t i = 0; i < done.size(); ++i)
+				reap(i);
+			syscall(SYS_io_destroy, aio);
+			aio = 0;
+		}
+		for(size_t i = 0; i < pool.size(); ++i)
+			free(pool[i]);
+		pool.clear();
+		close(directFd);
+		directFd = -1;
+		lseek(fd, offset, SEEK_SET);
+	}
+
+	/// @brief Hands out the next buffer read directly
+	long nextDirect(const char* &p){
+		if(handed >= 0){
+			submit(handed);
+			handed = -1;
+		}
+		if(done[head] == -3){
+			//the whole blocks are read, the tail goes through the page cache
+			stopDirect();
+			return next(p);
+		}
+		reap(head);
+		long n = done[head];
+		if(n <= 0 or (n < bufferSize and offset + n < directEnd)){
+			stopDirect();
+			return next(p);
+		}
+		p = pool[head];
+		offset += n;
+		handed = head;
+		head = (head + 1) % pool.size();
+		return n;
+	}
+
+public:
+	/// @brief How the file goes through the page cache
+	enum ioMode{
+		CACHED,		///< @brief Plain reads, the pages stay cached
+		ONCE,		///< @brief Read ahead and drop the pages behind the scan
+		DIRECT		///< @brief O_DIRECT reads into aligned buffers, bypassing the page cache
+	};
+	ioMode mode;
+	long window;		///< @brief Bytes read ahead, and dropped at a time, when streaming once
+	size_t buffers;		///< @brief Number of buffers reading directly
+	long bufferSize;	///< @brief Size of each buffer, a multiple of alignment
+	long alignment;		///< @brief Alignment of the direct reads and their buffers
+
+	inputFile() : block(65536){
+		fd = directFd = -1;
+		aio = 0;
+		offset = advised = dropped = 0;
+		mode = CACHED;
+		window = 8 << 20;
+		buffers = 4;
+		bufferSize = 1 << 20;
+		alignment = 4096;
+	}
+
+	~inputFile(){
+		if(directFd >= 0)
+			stopDirect();
+		if(fd >= 0)
+			close(fd);
+	}
+
+	/// @brief Opens the file
+	/// @return false if it can not be read
+	bool open(const char* path){
+		fd = ::open(path, O_RDONLY);
+		if(fd < 0)
+			return false;
+		if(mode == ONCE)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		struct stat st;
+		if(mode != DIRECT or fstat(fd, &st) < 0 or (directFd = ::open(path, O_RDONLY | O_DIRECT)) < 0)
+			return true;
+		directEnd = st.st_size / alignment * alignment;
+		if(syscall(SYS_io_setup, buffers, &aio) < 0)
+			aio = 0;
+		pool.assign(buffers, NULL);
+		reads.resize(buffers);
+		done.assign(buffers, -3);
+		for(size_t i = 0; i < buffers; ++i){
+			if(posix_memalign((void**)&pool[i], alignment, bufferSize) != 0){
+				stopDirect();
+				return true;
+			}
+		}
+		head = 0;
+		handed = -1;
+		submitted = 0;
+		for(size_t i = 0; i < buffers; ++i)
+			submit(i);
+		return true;
+	}
+
+	/// @brief Reads the next block
+	/// @param p Set to the start of the block, valid until the next call
+	/// @return Number of bytes read, 0 at the end of the file or if it is not open
+	long next(const char* &p){
+		if(fd < 0)
+			return 0;
+		if(directFd >= 0)
+			return nextDirect(p);
+		if(mode == ONCE){
+			//the scan is done with what was read before, its pages can go
+			if(offset - dropped >= window){
+				posix_fadvise(fd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+				dropped = offset;
+			}
+			if(advised < offset + window){
+				posix_fadvise(fd, advised, window, POSIX_FADV_WILLNEED);
+				advised += window;
+			}
+		}
+		ssize_t n;
+		while((n = read(fd, &block[0], block.size())) < 0 and errno == EINTR);
+		if(n <= 0){
+			if(mode == ONCE)
+				posix_fadvise(fd, dropped, 0, POSIX_FADV_DONTNEED);
+			return 0;
+		}
+		offset += n;
+		p = &block[0];
+		return n;
+	}
+};
+
+/// @brief Cuts the blocks of an inputFile into whole <DOC> records, for the scans that take a
+/// message whole (the token engine and the scheduler). The records ending in a block are handed
+/// out where the block was read, without a copy. A record cut off by the end of a block is
+/// copied aside and handed out once the block holding its </DOC> is read, so the input is
+/// never held in memory beyond a block and the one record running over it.
+class recordReader{
+	inputFile &file;
+	const char* p;		///< @brief Rest of the current block
+	const char* end;
+	long offset;		///< @brief File offset of p
+	string pending;		///< @brief A record cut off by the end of a block, read so far
+	string held;		///< @brief The last such record handed out
+
+public:
+	/// @param f The file, opened
+	recordReader(inputFile &f) : file(f){
+		p = end = NULL;
+		offset = 0;
+	}
+
+	/// @brief Finds the next run of whole records
+	/// @param start Set to the first record, valid until the next call
+	/// @param at Set to its offset in the file
+	/// @return Bytes in the run, 0 at the end of the file
+	long next(const char* &start, long &at){
+		for(;;){
+			if(p == end){
+				const char* b;
+				long n = file.next(b);
+				if(n <= 0){
+					//the end of the file ends the last record
+					held.swap(pending);
+					pending.clear();
+					start = held.data();
+					at = offset - held.size();
+					return held.size();
+				}
+				p = b;
+				end = b + n;
+			}
+
+			//a record cut off ends at the first </DOC> of the block, the tag maybe straddling the two
+			if(!pending.empty()){
+				size_t had = pending.size();
+				pending.append(p, std::min(end - p, 5L));
+				size_t f = pending.find("</DOC>", had - std::min(had, (size_t)5));
+				pending.resize(had);
+				const char* cut;
+				if(f != string::npos)
+					cut = p + (f + 6 - had);
+				else if((cut = (const char*)memmem(p, end - p, "</DOC>", 6)) != NULL)
+					cut += 6;
+				else
+					cut = end;
+				pending.append(p, cut);
+				offset += cut - p;
+				p = cut;
+				if(f == string::npos and cut == end)
+					continue;
+				held.swap(pending);
+				pending.clear();
+				start = held.data();
+				at = offset - held.size();
+				return held.size();
+			}
+
+			//the records ending in the block are handed out in place, the rest is put aside
+			const char* last = end;
+			while(last - p >= 6 and memcmp(last - 6, "</DOC>", 6) != 0)
+				--last;
+			if(last - p < 6){
+				pending.assign(p, end);
+				offset += end - p;
+				p = end;
+				continue;
+			}
+			start = p;
+			at = offset;
+			long n = last - p;
+			offset += n;
+			p = last;
+			return n;
+		}
+	}
+};
+
+/// @brief Writes the records of an input file to ham and spam files by their verdicts.
+/// Each record owns the bytes from its <DOC> tag to the next record's, and the last one the
+/// rest of the file. Records are added in file order and a run of records with the same
+/// verdict is copied in one call once the verdict changes, from the input file to the output
+/// inside the kernel (copy_file_range, or sendfile where the files do not allow it), so the
+/// message bytes never pass through user space.
+class splitter{
+	int input;			///< @brief The input file
+	int output[3];		///< @brief Files for spam, ham and undecided records, by verdict
+	int runVerdict;		///< @brief Verdict of the run not copied yet, -1 before the first record
+	long runStart;		///< @brief Offset where the run not copied yet starts
+
+	/// @brief Copies a range of the input to the end of an output
+	/// @param v Verdict of the records in the range, choosing the output
+	/// @return false if the copy failed
+	bool copy(int v, long from, long until){
+		int to = output[v];
+		loff_t off = from;
+		bool fallback = false;
+		while(off < until){
+			ssize_t n = fallback ? -1 : copy_file_range(input, &off, to, NULL, until - off, 0);
+			if(n < 0 and !fallback and (errno == EXDEV or errno == ENOSYS or errno == EINVAL or errno == EOPNOTSUPP)){
+				fallback = true;
+				continue;
+			}
+			if(fallback){
+				off_t o = off;
+				n = sendfile(to, input, &o, until - off);
+				if(n > 0)
+					off = o;
+			}
+			if(n < 0 and errno == EINTR)
+				continue;
+			if(n < 0){
+				cerr << "Error: can not copy the records: " << strerror(errno) << endl;
+				return false;
+			}
+			if(n == 0)
+				break;
+			bytes[v] += n;
+		}
+		++calls;
+		return true;
+	}
+
+public:
+	long bytes[3];		///< @brief Bytes written to each output, by verdict
+	long calls;			///< @brief Copies made, one per run of records
+
+	/// @param in The input file
+	/// @param spam File for the spam records
+	/// @param ham File for the ham records
+	/// @param undecided File for the records a budget left undecided, may be ham
+	splitter(int in, int spam, int ham, int undecided) : input(in){
+		output[SPAM] = spam;
+		output[NOT_SPAM] = ham;
+		output[UNDECIDED] = undecided;
+		runVerdict = -1;
+		runStart = 0;
+		bytes[0] = bytes[1] = bytes[2] = 0;
+		calls = 0;
+	}
+
+	/// @brief Adds the next records of the input, copying the runs they end
+	/// @param ended The records, in file order
+	/// @return false if a copy failed
+	bool add(const vector<endedDoc> &ended){
+		for(size_t i = 0; i < ended.size(); ++i){
+			if((int)ended[i].outcome == runVerdict)
+				continue;
+			if(runVerdict >= 0 and !copy(runVerdict, runStart, ended[i].start))
+				return false;
+			runVerdict = ended[i].outcome;
+			runStart = ended[i].start;
+		}
+		return true;
+	}
+
+	/// @brief Copies the last run, up to the end of the input
+	/// @param size Length of the input
+	/// @return false if the copy failed
+	bool finish(long size){
+		if(runVerdict >= 0 and !copy(runVerdict, runStart, size))
+			return false;
+		runVerdict = -1;
+		return true;
+	}
+
+	/// @brief Orders records by their place in the file
+	static bool earlier(const endedDoc &a, const endedDoc &b){ return a.start < b.start; }
+
+	/// @brief Prints the bytes written and copies made to standard error
+	void printStats() const{
+		cerr << "split: " << bytes[SPAM] << " spam bytes, " << bytes[NOT_SPAM] << " ham bytes, "
+			<< bytes[UNDECIDED] << " undecided bytes in " << calls << " copies" << endl;
+	}
+};
+
+/// @brief Keywords shorter than this stay exact when a default edit distance is given
+/// @note Edits on short words like "win" would match far too many ordinary words ("in", "wit", "tin")
+const size_t minFuzzyLength = 5;
+
+/// @brief Default cap on the number of keyword states built by subset construction
+size_t maxKeywordStates = 10000;
+
+
+/// @brief Prints the command line options to standard error
+/// @param prog The name the program was invoked with
+void usage(const char* prog){
+	cerr << "Usage: " << prog << " [-l leading] [-t trailing] [-e set]..." << endl
+		<< "  -l chars  bytes which may precede a spam keyword (default space and \")" << endl
+		<< "  -t chars  bytes which may follow a spam keyword (default space and \")" << endl
+		<< "  -e chars  treat the characters as the same keyword letter, e.g. -e e3 -e il1" << endl
+		<< "  -k word   add a spam keyword or phrase, word~N also accepts N edits" << endl
+		<< "  -f N      accept N edits in keywords of at least " << minFuzzyLength << " characters (default 0)" << endl
+		<< "  -m N      limit the keyword automaton to N states (default " << maxKeywordStates << ")" << endl
+		<< "  -a word   add an allowlist keyword or phrase, vetoing spam keywords in its message" << endl
+		<< "  -r rule   report messages holding all of the keywords joined by &, keywords starting" << endl
+		<< "            with ! must be absent, e.g. -r \"free trials & winners\" -r \"win & !unsubscribe\"," << endl
+		<< "            \"A /N B\" needs A and B within N words, e.g. -r \"free trials /5 winners\"," << endl
+		<< "            \"A >=N\" needs A found N times, e.g. -r \"winners >=3\"," << endl
+		<< "            a final @N only looks at the first N body bytes, e.g. -r \"free access @200\"" << endl
+		<< "  -D N      scan at most N bytes of each message body" << endl
+		<< "  -Q N      time slice messages in quanta of N bytes, so long messages do not hold up short ones" << endl
+		<< "  -J N      scan the shortest message first, moving a waiting one ahead a byte per N bytes scanned" << endl
+		<< "  -L N      queue messages over N bytes apart, taking turns with the others" << endl
+		<< "  -S path   serve on a Unix socket, answering each message sent with its verdict" << endl
+		<< "  -H hi,lo  answer busy once hi messages are queued, until lo are left (default 1024,512)" << endl
+		<< "  -P N      serve from N worker processes sharing the automaton built once" << endl
+		<< "  -C N      stop reading from a connection while N of its messages are unanswered (default 64)" << endl
+		<< "  -X N      answer busy to a message over N bytes instead of buffering it (default 16 MB)" << endl
+		<< "  -p N      prefetch the input N bytes ahead of the scan, and the next message and its resumed transition" << endl
+		<< "  -I mode   read messagefile.txt through the page cache (cache, the default) or stream it" << endl
+		<< "            once, reading ahead and dropping the pages scanned (once), or bypass the page" << endl
+		<< "            cache with O_DIRECT reads into aligned buffers (direct)" << endl
+		<< "  -O h,s    copy the ham records of messagefile.txt to file h and the spam ones to s, undecided" << endl
+		<< "            ones to a third file if given, else with the ham ones" << endl
+		<< "  -B N      leave a message undecided once N of its bytes are scanned" << endl
+		<< "  -W ms     leave a message undecided once it takes ms milliseconds to scan" << endl
+		<< "  -K file   add the spam keywords listed one per line in file" << endl
+		<< "  -T        match whole words with the token hash engine instead of the character automaton" << endl
+		<< "  -M layout store the automaton as a full row per state (dense, the default) or with sparse" << endl
+		<< "            rows for the states leaving the common transition in few byte classes (hybrid)," << endl
+		<< "            or with those rows overlaid at displaced offsets in one array (displaced)" << endl
+		<< "  -V        scan batches of short messages one at a time instead of in AVX2 vector lanes" << endl
+		<< "  -s        print automaton size and scan throughput to standard error" << endl;
 }
 
-/// @brief Transition action resetting the current message ID to zero
-void newMsg(char){
-	currentMessageNum = 0;
+/// @brief Prints the IDs of the spam messages found, and of any left undecided by a budget, emptying the lists
+void reportSpam(){
+	cout << "The following messages were spam:";
+	while(!(spamMessages.empty())){
+		cout << ' '<< spamMessages.front();
+		spamMessages.pop_front();
+	}
+	cout << endl;
+	if(!undecidedMessages.empty()){
+		cout << "The following messages were undecided (offset reached):";
+		while(!(undecidedMessages.empty())){
+			cout << ' '<< undecidedMessages.front().first << '(' << undecidedMessages.front().second << ')';
+			undecidedMessages.pop_front();
+		}
+		cout << endl;
+	}
 }
 
-/// @brief Transition action making the given input symbol digit the new ones place of the current message ID
-/// @param c the ASCII digit to reinterpret as the new one's place
-/// @note previous value multiplied by 10 become the 10s place and beyond
-void handleMIDdig(char c){
-	int digit = c - '0';
-	currentMessageNum *= 10;
-	currentMessageNum += digit;
+/// @brief Adds a keyword from its command line form
+/// @param arg The keyword text, optionally followed by ~ and its edit distance
+/// @param ham True for an allowlist keyword
+void addKeyword(const char* arg, bool ham = false){
+	string text = arg;
+	size_t tilde = text.rfind('~');
+	if(tilde == string::npos)
+		keywords.push_back(keyword(text, -1, ham));
+	else
+		keywords.push_back(keyword(text.substr(0, tilde), atoi(text.c_str() + tilde + 1), ham));
+}
+
+/// @brief Finds or adds the keyword named by a rule
+/// @param text The keyword, surrounding spaces are ignored
+/// @return Index of the keyword in keywords
+int ruleKeyword(string text){
+	text.erase(0, text.find_first_not_of(" \t"));
+	text.erase(text.find_last_not_of(" \t") + 1);
+	size_t k;
+	for(k = 0; k < keywords.size() and keywords[k].text != text; ++k);
+	if(k == keywords.size())
+		keywords.push_back(keyword(text));
+	keywords[k].inRule = true;
+	return k;
 }
 
-/// @brief Transition action adding the current message ID to the list of spam IDs
-void recordSpam(char){
-	spamMessages.push_back(currentMessageNum);
+/// @brief Adds a document rule from its command line form
+/// @param text Keywords, counted keywords ("A >=N") or proximity terms ("A /N B") joined by &,
+/// each one prefixed by ! if it must be absent, optionally followed by "@N" to only look at the first N body bytes
+/// @note Keywords named by the rule are added if they are not keywords yet, and no longer make a message spam on their own
+void addRule(string text){
+	rule r;
+	size_t at = text.rfind('@');
+	if(at != string::npos and text.find_first_not_of(" \t0123456789", at + 1) == string::npos){
+		r.within = atol(text.c_str() + at + 1);
+		text.erase(at);
+	}
+	stringstream ss(text);
+	string term;
+	while(std::getline(ss, term, '&')){
+		bool absent = false;
+		size_t first = term.find_first_not_of(" \t");
+		if(first != string::npos and term[first] == '!'){
+			absent = true;
+			first = term.find_first_not_of(" \t", first + 1);
+		}
+		if(first == string::npos)
+			continue;
+		term = term.substr(first, term.find_last_not_of(" \t") + 1 - first);
+
+		//"A /N B" holds when A and B are found within N words of each other
+		size_t slash = term.find(" /");
+		if(slash != string::npos and digits(term[slash+2], 0)){
+			nearTerm n;
+			n.words = atoi(term.c_str() + slash + 2);
+			size_t rest = term.find_first_not_of("0123456789", slash + 2);
+			n.a = ruleKeyword(term.substr(0, slash));
+			n.b = ruleKeyword(rest == string::npos ? "" : term.substr(rest));
+			nearTerms.push_back(n);
+			(absent ? r.nearWithout : r.nearNeed).push_back(nearTerms.size() - 1);
+		}else{
+			//"A >=N" needs A found at least N times
+			int times = 1;
+			size_t ge = term.rfind(">=");
+			if(ge != string::npos and term.find_first_not_of(" \t0123456789", ge + 2) == string::npos){
+				times = atoi(term.c_str() + ge + 2);
+				term.erase(ge);
+			}
+			(absent ? r.without : r.need).push_back(ruleKeyword(term));
+			(absent ? r.withoutCount : r.needCount).push_back(times < 1 ? 1 : times > 255 ? 255 : times);
+		}
+	}
+	rules.push_back(r);
 }
 
 /// @brief Reads input messages from "./messagefile.txt" and records if they are spam or not
 /// @return Unix exit code, 0 for success
-int main(int, char**){
-	std::ifstream file;
+int main(int argc, char** argv){
+	for(int i=0; i<256; ++i) foldClass[i] = i;
+	setDelimiters(" \"", LEADING_DELIMITER);
+	setDelimiters(" \"", TRAILING_DELIMITER);
+
+	int defaultFuzz = 0;
+	bool stats = false;
+	bool tokens = false;
+	long quantum = 0;
+	long aging = 0;
+	long largeSize = 0;
+	const char* servePath = NULL;
+	long highWater = 1024, lowWater = 512;
+	long credit = 64;
+	long maxMessage = 16 << 20;
+	int workers = 0;
+	inputFile::ioMode ioMode = inputFile::CACHED;
+	DFAtable::layoutKind layout = DFAtable::DENSE;
+	vector<string> splitPaths;
+	vector<string> ruleText;
+	int opt;
+	while((opt = getopt(argc, argv, "l:t:e:k:a:r:f:m:K:D:B:W:Q:J:L:S:H:C:P:O:I:p:M:X:TVs")) != -1){
+		switch(opt){
+		case 'l':
+			setDelimiters(optarg, LEADING_DELIMITER);
+			break;
+		case 't':
+			setDelimiters(optarg, TRAILING_DELIMITER);
+			break;
+		case 'e':
+			addEquivalence(optarg);
+			break;
+		case 'k':
+			addKeyword(optarg);
+			break;
+		case 'a':
+			addKeyword(optarg, true);
+			break;
+		case 'r':
+			ruleText.push_back(optarg);
+			break;
+		case 'f':
+			defaultFuzz = atoi(optarg);
+			break;
+		case 'm':
+			maxKeywordStates = atoi(optarg);
+			break;
+		case 'D':
+			maxScanDepth = atol(optarg);
+			break;
+		case 'Q':
+			quantum = atol(optarg);
+			break;
+		case 'J':
+			aging = atol(optarg);
+			break;
+		case 'L':
+			largeSize = atol(optarg);
+			break;
+		case 'S':
+			servePath = optarg;
+			break;
+		case 'H':
+			highWater = atol(optarg);
+			lowWater = strchr(optarg, ',') ? atol(strchr(optarg, ',') + 1) : highWater / 2;
+			break;
+		case 'P':
+			workers = atoi(optarg);
+			break;
+		case 'C':
+			credit = atol(optarg);
+			break;
+		case 'X':
+			maxMessage = atol(optarg);
+			break;
+		case 'p':
+			prefetchDistance = atol(optarg);
+			break;
+		case 'I':
+			if(strcmp(optarg, "once") == 0){
+				ioMode = inputFile::ONCE;
+			}else if(strcmp(optarg, "direct") == 0){
+				ioMode = inputFile::DIRECT;
+			}else if(strcmp(optarg, "cache") != 0){
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'M':
+			if(strcmp(optarg, "hybrid") == 0){
+				layout = DFAtable::HYBRID;
+			}else if(strcmp(optarg, "displaced") == 0){
+				layout = DFAtable::DISPLACED;
+			}else if(strcmp(optarg, "dense") != 0){
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'O':{
+			stringstream ss(optarg);
+			string path;
+			while(std::getline(ss, path, ','))
+				splitPaths.push_back(path);
+			break;
+		}
+		case 'B':
+			docByteBudget = atol(optarg);
+			break;
+		case 'W':
+			docTimeBudget = atof(optarg) / 1000;
+			break;
+		case 'K':{
+			std::ifstream list(optarg);
+			if(!list){
+				cerr << "Error: can not read keyword file " << optarg << endl;
+				return -1;
+			}
+			string line;
+			while(std::getline(list, line))
+				if(!line.empty()) addKeyword(line.c_str());
+			break;
+		}
+		case 'T':
+			tokens = true;
+			break;
+		case 'V':
+			laneStepping = false;
+			break;
+		case 's':
+			stats = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	//the built in spam keywords, with the default edit distance applied to long ones
+	const char* builtin[] = {"win", "winners", "winnings", "free access", "free software", "free vacation", "free trials"};
+	for(size_t i=0; i < sizeof(builtin)/sizeof(*builtin); ++i){
+		size_t k;
+		for(k=0; k < keywords.size() and keywords[k].text != builtin[i]; ++k);
+		if(k == keywords.size()) keywords.push_back(keyword(builtin[i]));
+	}
+	for(size_t i=0; i < ruleText.size(); ++i) addRule(ruleText[i]);
+	for(size_t i=0; i < keywords.size(); ++i)
+		if(keywords[i].fuzz < 0)
+			keywords[i].fuzz = keywords[i].text.size() >= minFuzzyLength ? defaultFuzz : 0;
+	setupRules();
+
+	inputFile file;
+	file.mode = ioMode;
 	file.open("messagefile.txt");
 
+	if(tokens and (quantum > 0 or aging > 0 or largeSize > 0 or servePath or !splitPaths.empty())){
+		cerr << "Error: -Q, -J, -L, -S and -O need the character automaton, the token engine scans messages whole" << endl;
+		return -1;
+	}
+	if(!splitPaths.empty() and (servePath or splitPaths.size() < 2 or splitPaths.size() > 3)){
+		cerr << "Error: -O takes ham,spam or ham,spam,undecided files and splits messagefile.txt, not served messages" << endl;
+		return -1;
+	}
+	if(tokens){
+		for(size_t i=0; i < keywords.size(); ++i){
+			if(keywords[i].fuzz > 0){
+				cerr << "Error: the token engine matches exact keywords only (" << keywords[i].text << ")" << endl;
+				return -1;
+			}
+		}
+		tokenEngine engine;
+		engine.build();
+		if(stats)
+			engine.printStats();
+		double began = now();
+		recordReader records(file);
+		const char* p;
+		long at, n, scanned = 0;
+		while((n = records.next(p, at)) > 0){
+			engine.scan(p, p + n);
+			scanned += n;
+		}
+		if(stats)
+			cerr << "scanned " << scanned << " bytes in " << now() - began << " s" << endl;
+		reportSpam();
+		return 0;
+	}
+
 	// The states of the automaton
 	DFAstate start;
 	DFAstate openDoc[5];
@@ -168,22 +3612,11 @@ int main(int, char**){
 	DFAstate subject;
 	DFAstate notdelimited;
 	DFAstate delimited;
-	DFAstate free_stuff[5];
-	DFAstate free_access[6];
-	DFAstate free_software[8];
-	DFAstate free_vacation[8];
-	DFAstate free_trials[6];
-	DFAstate win[4];
-	DFAstate winners[3];
-	DFAstate winnings[4];
 	DFAstate isSpam;
 	DFAstate closeDoc[5];
 	DFAstate closeDocSpam[5];
-
-	//set start as the start state
-	DFAstate *currentstate = &start;
-
-	int input;
+	DFAstate skipDoc;
+	DFAstate closeDocSkip[5];
 
 	//give all the states printable names
 	start.name = "start";
@@ -191,21 +3624,15 @@ int main(int, char**){
 	delimited.name = "delimited";
 	notdelimited.name = "not-delimited";
 	isSpam.name = "isSpam";
+	skipDoc.name = "skipDoc";
 	for(int i=0; i< 5; ++i) openDoc[i].iteratedname("openDoc_", i);
 	for(int i=0; i< 7; ++i) openDocID[i].iteratedname("openDocID_", i);
 	for(int i=0; i< 3; ++i) msg[i].iteratedname("msg_", i);
 	for(int i=0; i< 2; ++i) msgdig[i].iteratedname("msgdig_", i);
 	for(int i=0; i< 8; ++i) closeDocID[i].iteratedname("closeDocID_", i);
-	for(int i=0; i< 5; ++i) free_stuff[i].iteratedname("free_stuff_", i);
-	for(int i=0; i< 6; ++i) free_access[i].iteratedname("free_access_", i);
-	for(int i=0; i< 8; ++i) free_software[i].iteratedname("free_software_", i);
-	for(int i=0; i< 8; ++i) free_vacation[i].iteratedname("free_vacation_", i);
-	for(int i=0; i< 6; ++i) free_trials[i].iteratedname("free_trials_", i);
-	for(int i=0; i< 4; ++i) win[i].iteratedname("win_", i);
-	for(int i=0; i< 3; ++i) winners[i].iteratedname("winners_", i);
-	for(int i=0; i< 4; ++i) winnings[i].iteratedname("winnings_", i);
 	for(int i=0; i< 5; ++i) closeDoc[i].iteratedname("closeDoc_", i);
 	for(int i=0; i< 5; ++i) closeDocSpam[i].iteratedname("closeDocSpam_", i);
+	for(int i=0; i< 5; ++i) closeDocSkip[i].iteratedname("closeDocSkip_", i);
 
 	//Begin defining the transition functions
 
@@ -249,7 +3676,7 @@ int main(int, char**){
 	msg[2].addTransition(&everything,start);
 	msgdig[0].addTransition(&justChar,closeDocID[0],NULL,'<');
 	msgdig[0].addTransition(&whitespace,msgdig[1]);
-	msgdig[0].addTransition(&digits,msgdig[1],&handleMIDdig);//parse additional digits of the message ID
+	msgdig[0].addTransition(&digits,msgdig[0],&handleMIDdig);//parse additional digits of the message ID
 	msgdig[0].addTransition(&everything,start);
 	msgdig[1].addTransition(&justChar,closeDocID[0],NULL,'<');
 	msgdig[1].addTransition(&whitespace,msgdig[1]);
@@ -272,40 +3699,38 @@ int main(int, char**){
 	//all states return to subject until a line of only whitespace is encountered.
 	closeDocID[7].addTransition(&justChar, subject, NULL, '\n');
 	closeDocID[7].addTransition(&everything,closeDocID[7]);
-	subject.addTransition(&justChar, delimited, NULL, '\n');
+	subject.addTransition(&justChar, delimited, &startBody, '\n');
 	subject.addTransition(&whitespace,subject);
 	subject.addTransition(&everything,closeDocID[7]);
 
+	//word ends are only counted when proximity terms need the word positions
+	charConsumer wordEnd = nearTerms.empty() ? NULL : &nextWord;
+
 	//Spam keywords must begin with a delimiter (space or doublequote)
 	notdelimited.addTransition(&justChar, closeDoc[0], NULL, '<'); //if we process the open angle we start checking for the closing DOC tag
-	notdelimited.addTransition(&delimiters, delimited); //if we process a delimter we go to that state
+	notdelimited.addTransition(&delimiters, delimited, wordEnd); //if we process a delimter we go to that state
 	notdelimited.addTransition(&everything,notdelimited); //otherwise we process all other input and stay put
 
-	delimited.addTransition(&justChar, free_stuff[0], NULL, 'f'); //if we encounter 'f' check spam keywords beginning with f
-	delimited.addTransition(&justChar, win[0], NULL, 'w');		//if we encounter 'w' check spam keywords starting with w
-	delimited.addTransition(&justChar, closeDoc[0], NULL, '<');	//if we encounter the angle bracket check for end of document tag
-	delimited.addTransition(&delimiters, delimited);			//stay in delimited if another delimiter enctountered
-	delimited.addTransition(&everything, notdelimited);			//for all other cases go to notdelimited state
-
+	//delimited and the keyword states following it are built from the keyword list below
 	//Once a message is declared spam it stays spam until the end of document
 	isSpam.addTransition(&justChar, closeDocSpam[0], NULL, '<');
 	isSpam.addTransition(&everything, isSpam);
 
 	//check non-spam message for end of document.
 	closeDoc[0].addTransition(&justChar, closeDoc[1], NULL, '/');
-	closeDoc[0].addTransition(&delimiters, delimited);
+	closeDoc[0].addTransition(&delimiters, delimited, wordEnd);
 	closeDoc[0].addTransition(&everything, notdelimited);
 	closeDoc[1].addTransition(&justChar, closeDoc[2], NULL, 'D');
-	closeDoc[1].addTransition(&delimiters, delimited);
+	closeDoc[1].addTransition(&delimiters, delimited, wordEnd);
 	closeDoc[1].addTransition(&everything, notdelimited);
 	closeDoc[2].addTransition(&justChar, closeDoc[3], NULL, 'O');
-	closeDoc[2].addTransition(&delimiters, delimited);
+	closeDoc[2].addTransition(&delimiters, delimited, wordEnd);
 	closeDoc[2].addTransition(&everything, notdelimited);
 	closeDoc[3].addTransition(&justChar, closeDoc[4], NULL, 'C');
-	closeDoc[3].addTransition(&delimiters, delimited);
+	closeDoc[3].addTransition(&delimiters, delimited, wordEnd);
 	closeDoc[3].addTransition(&everything, notdelimited);
-	closeDoc[4].addTransition(&justChar, start, NULL, '>');//if </DOC> completed return to start state
-	closeDoc[4].addTransition(&delimiters, delimited);
+	closeDoc[4].addTransition(&justChar, start, &endDoc, '>');//if </DOC> completed decide the message and return to start state
+	closeDoc[4].addTransition(&delimiters, delimited, wordEnd);
 	closeDoc[4].addTransition(&everything, notdelimited);
 
 	//check spam message for end of document
@@ -317,157 +3742,161 @@ int main(int, char**){
 	closeDocSpam[2].addTransition(&everything,isSpam);
 	closeDocSpam[3].addTransition(&justChar, closeDocSpam[4], NULL, 'C');
 	closeDocSpam[3].addTransition(&everything,isSpam);
-	closeDocSpam[4].addTransition(&justChar, start, NULL, '>');//if </DOC> completed return to start state
+	closeDocSpam[4].addTransition(&justChar, start, &endDoc, '>');//if </DOC> completed return to start state
 	closeDocSpam[4].addTransition(&everything,isSpam);
 
-	// Spam keyword "win" and keyowrds starting in "winn"
-	win[0].addTransition(&justChar, win[1], NULL, 'i');
-	win[0].addTransition(&delimiters, delimited);
-	win[0].addTransition(&everything, notdelimited);
-	win[1].addTransition(&justChar, win[2], NULL, 'n');
-	win[1].addTransition(&delimiters, delimited);
-	win[1].addTransition(&everything, notdelimited);
-	win[2].addTransition(&justChar,win[3],NULL, 'n');
-	win[2].addTransition(&delimiters, isSpam, &recordSpam);
-	win[2].addTransition(&everything, notdelimited);
-	win[3].addTransition(&justChar, winners[0], NULL, 'e');
-	win[3].addTransition(&justChar, winnings[0], NULL, 'i');
-	win[3].addTransition(&delimiters, delimited);
-	win[3].addTransition(&everything, notdelimited);
-
-	//complete "winn" to "winners"
-	winners[0].addTransition(&justChar,winners[1],NULL, 'r');
-	winners[0].addTransition(&delimiters, delimited);
-	winners[0].addTransition(&everything, notdelimited);
-	winners[1].addTransition(&justChar, winners[2], NULL, 's');
-	winners[1].addTransition(&delimiters, isSpam, &recordSpam);
-	winners[1].addTransition(&everything, notdelimited);
-	winners[2].addTransition(&delimiters, isSpam, &recordSpam);//when transitioning to the isSpam state add the current message ID to the list
-	winners[2].addTransition(&everything, notdelimited);
-
-	//complete "winn" to "winnings"
-	winnings[0].addTransition(&justChar,winnings[1],NULL,'n');
-	winnings[0].addTransition(&delimiters, delimited);
-	winnings[0].addTransition(&everything, notdelimited);
-	winnings[1].addTransition(&justChar,winnings[2],NULL,'g');
-	winnings[1].addTransition(&delimiters, delimited);
-	winnings[1].addTransition(&everything, notdelimited);
-	winnings[2].addTransition(&justChar,winnings[3],NULL,'s');
-	winnings[2].addTransition(&delimiters, delimited);
-	winnings[2].addTransition(&everything, notdelimited);
-	winnings[3].addTransition(&delimiters, isSpam, &recordSpam);
-	winnings[3].addTransition(&everything, notdelimited);
-
-	//all keyphrases starting with "free "
-	free_stuff[0].addTransition(&justChar, free_stuff[1], NULL, 'r');
-	free_stuff[0].addTransition(&delimiters, delimited);
-	free_stuff[0].addTransition(&everything, notdelimited);
-	free_stuff[1].addTransition(&justChar, free_stuff[2], NULL, 'e');
-	free_stuff[1].addTransition(&delimiters, delimited);
-	free_stuff[1].addTransition(&everything, notdelimited);
-	free_stuff[2].addTransition(&justChar, free_stuff[3], NULL, 'e');
-	free_stuff[2].addTransition(&delimiters, delimited);
-	free_stuff[2].addTransition(&everything, notdelimited);
-	free_stuff[3].addTransition(&justChar, free_stuff[4], NULL, ' ');
-	free_stuff[3].addTransition(&justChar, delimited, NULL, '\"');
-	free_stuff[3].addTransition(&everything, notdelimited);
-	free_stuff[4].addTransition(&justChar, free_stuff[0], NULL, 'f');
-	free_stuff[4].addTransition(&justChar, win[0], NULL, 'w');
-	free_stuff[4].addTransition(&justChar, closeDoc[0], NULL, '<');
-	free_stuff[4].addTransition(&justChar, free_access[0], NULL, 'a');
-	free_stuff[4].addTransition(&justChar, free_software[0], NULL, 's');
-	free_stuff[4].addTransition(&justChar, free_trials[0], NULL, 't');
-	free_stuff[4].addTransition(&justChar, free_vacation[0], NULL, 'v');
-	free_stuff[4].addTransition(&delimiters, delimited);
-	free_stuff[4].addTransition(&everything, notdelimited);
-
-	free_access[0].addTransition(&justChar, free_access[1], NULL, 'c');
-	free_access[0].addTransition(&delimiters,delimited);
-	free_access[0].addTransition(&everything, notdelimited);
-	free_access[1].addTransition(&justChar, free_access[2], NULL, 'c');
-	free_access[1].addTransition(&delimiters,delimited);
-	free_access[1].addTransition(&everything, notdelimited);
-	free_access[2].addTransition(&justChar, free_access[3], NULL, 'e');
-	free_access[2].addTransition(&delimiters,delimited);
-	free_access[2].addTransition(&everything, notdelimited);
-	free_access[3].addTransition(&justChar, free_access[4], NULL, 's');
-	free_access[3].addTransition(&delimiters,delimited);
-	free_access[3].addTransition(&everything, notdelimited);
-	free_access[4].addTransition(&justChar, free_access[5], NULL, 's');
-	free_access[4].addTransition(&delimiters,delimited);
-	free_access[4].addTransition(&everything, notdelimited);
-	free_access[5].addTransition(&delimiters, isSpam, &recordSpam);
-	free_access[5].addTransition(&everything, notdelimited);
-
-	free_software[0].addTransition(&justChar, free_software[1], NULL, 'o');
-	free_software[1].addTransition(&justChar, free_software[2], NULL, 'f');
-	free_software[2].addTransition(&justChar, free_software[3], NULL, 't');
-	free_software[3].addTransition(&justChar, free_software[4], NULL, 'w');
-	free_software[4].addTransition(&justChar, free_software[5], NULL, 'a');
-	free_software[5].addTransition(&justChar, free_software[6], NULL, 'r');
-	free_software[6].addTransition(&justChar, free_software[7], NULL, 'e');
-	for(int i=0; i<7; ++i) free_software[i].addTransition(&delimiters, delimited);
-	free_software[7].addTransition(&delimiters, isSpam, &recordSpam);
-	for(int i=0; i<=7; ++i) free_software[i].addTransition(&everything, notdelimited);
-
-	free_trials[0].addTransition(&justChar, free_trials[1], NULL, 'r');
-	free_trials[1].addTransition(&justChar, free_trials[2], NULL, 'i');
-	free_trials[2].addTransition(&justChar, free_trials[3], NULL, 'a');
-	free_trials[3].addTransition(&justChar, free_trials[4], NULL, 'l');
-	free_trials[4].addTransition(&justChar, free_trials[5], NULL, 's');
-	for(int i=0; i< 5; ++i) free_trials[i].addTransition(&delimiters, delimited);
-	free_trials[5].addTransition(&delimiters, isSpam, &recordSpam);
-	for(int i=0; i<=5; ++i) free_trials[i].addTransition(&everything, notdelimited);
-
-	free_vacation[0].addTransition(&justChar, free_vacation[1], NULL, 'a');
-	free_vacation[1].addTransition(&justChar, free_vacation[2], NULL, 'c');
-	free_vacation[2].addTransition(&justChar, free_vacation[3], NULL, 'a');
-	free_vacation[3].addTransition(&justChar, free_vacation[4], NULL, 't');
-	free_vacation[4].addTransition(&justChar, free_vacation[5], NULL, 'i');
-	free_vacation[5].addTransition(&justChar, free_vacation[6], NULL, 'o');
-	free_vacation[6].addTransition(&justChar, free_vacation[7], NULL, 'n');
-	for(int i=0; i<7; ++i) free_vacation[i].addTransition(&delimiters, delimited);
-	free_vacation[7].addTransition(&delimiters, isSpam, &recordSpam);
-	for(int i=0; i<=7; ++i) free_vacation[i].addTransition(&everything, notdelimited);
-	//finish defining the transition functions
+	//Once the keywords found settle a message as not spam, or the scan depth is reached, skip to the end of document
+	skipDoc.addTransition(&justChar, closeDocSkip[0], NULL, '<');
+	skipDoc.addTransition(&everything, skipDoc);
+	closeDocSkip[0].addTransition(&justChar, closeDocSkip[1], NULL, '/');
+	closeDocSkip[1].addTransition(&justChar, closeDocSkip[2], NULL, 'D');
+	closeDocSkip[2].addTransition(&justChar, closeDocSkip[3], NULL, 'O');
+	closeDocSkip[3].addTransition(&justChar, closeDocSkip[4], NULL, 'C');
+	closeDocSkip[4].addTransition(&justChar, start, &endDoc, '>');
+	for(int i=0; i< 5; ++i) closeDocSkip[i].addTransition(&everything, skipDoc);
 
-	input = 0;
+	//all spam keywords, merged into one set of states starting at delimited
+	keywordCompiler keywordStates(delimited, notdelimited, closeDoc[0]);
+	if(!keywordStates.build(maxKeywordStates)){
+		cerr << "Error: keyword automaton exceeds " << maxKeywordStates << " states, lower the edit distance" << endl;
+		return -1;
+	}
+	//finish defining the transition functions
 
-	//for each input character
-	do{
-		//If there was no transition function from the symbol (current state invalid)
-		if(NULL == currentstate){
-			//exit with error
-			cerr << "Error: Unhandled symbol:" << (char)input << endl;
-			return -1;
-		}
+	//flatten the automaton into a byte class table, start is state 0
+	//isSpam and skipDoc are only entered by the scan loop, once the rules settle a message or the scan depth is reached
+	DFAtable dfa;
+	vector<DFAstate*> settled;
+	settled.push_back(&isSpam);
+	settled.push_back(&skipDoc);
+	dfa.compile(start, settled);
+	if(layout != DFAtable::DENSE){
+		//keyword states differ from these rows only in the letters they go on with
+		vector<DFAstate*> defaults;
+		defaults.push_back(&delimited);
+		defaults.push_back(&notdelimited);
+		dfa.compact(layout, defaults);
+	}
+	int spamState = dfa.index[&isSpam], skipState = dfa.index[&skipDoc];
 
-		input = file.get();
+	//where the scan depth jump lands from each state, keeping a partly read </DOC>
+	vector<int> skipFrom(dfa.states.size(), skipState);
+	for(int i=0; i< 5; ++i)
+		if(dfa.index.count(&closeDoc[i])) skipFrom[dfa.index[&closeDoc[i]]] = dfa.index[&closeDocSkip[i]];
+	if(stats){
+		cerr << "automaton: " << dfa.states.size() << " states (" << keywordStates.size() << " keyword), "
+			<< dfa.numClasses << " byte classes, " << dfa.bytes() << " table bytes" << endl;
+	}
 
-		if(input >= 0){
-			//print the "name" of the current state
-			cout << '\"'<< currentstate->name << '\"';
+	if(servePath){
+		scheduler jobs(dfa, spamState, skipState, skipFrom, quantum > 0 ? quantum : LONG_MAX);
+		jobs.aging = aging;
+		jobs.largeSize = largeSize;
+		service server(jobs);
+		server.highWater = highWater;
+		server.lowWater = std::min(lowWater, highWater);
+		server.credit = credit;
+		server.maxMessage = maxMessage;
+		if(workers > 0)
+			return server.prefork(servePath, workers, stats);
+		int status = server.serve(servePath);
+		if(stats){
+			jobs.printStats();
+			server.printStats();
+		}
+		return status;
+	}
 
-			//print an arrow showing the input character for the transition
-			cout << '-' << char(input) << "->";
+	//the split outputs, undecided records going with the ham ones unless given a file of their own
+	splitter* split = NULL;
+	vector<endedDoc> ended;
+	if(!splitPaths.empty()){
+		int in = open("messagefile.txt", O_RDONLY);
+		int out[3];
+		for(size_t i = 0; i < splitPaths.size(); ++i){
+			out[i] = open(splitPaths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(out[i] < 0){
+				cerr << "Error: can not write " << splitPaths[i] << ": " << strerror(errno) << endl;
+				return -1;
+			}
+		}
+		if(in < 0){
+			cerr << "Error: can not read messagefile.txt: " << strerror(errno) << endl;
+			return -1;
+		}
+		split = new splitter(in, out[1], out[0], splitPaths.size() > 2 ? out[2] : out[0]);
+		endedMessages = &ended;
+	}
 
-			//transition out of the current state using the input symbol
-			currentstate= currentstate->transitionWithChar(input);
+	double began = now();
+	long scanned = 0;
 
-		}else{
-			//output <end> when an error was taken trying to get input from file.
-			cout << "<end>" << endl;
+	if(quantum > 0 or aging > 0 or largeSize > 0){
+		//one job per message, each ending with its </DOC>, queued a block of the file at a time
+		//and scanned where it was read, so the block is done with before the next is read
+		scheduler jobs(dfa, spamState, skipState, skipFrom, quantum > 0 ? quantum : LONG_MAX);
+		jobs.aging = aging;
+		jobs.largeSize = largeSize;
+		recordReader records(file);
+		const char* base;
+		long at, n;
+		while((n = records.next(base, at)) > 0){
+			const char* end = base + n;
+			for(const char* p = base; p < end; ){
+				const char* next = (const char*)memmem(p, end - p, "</DOC>", 6);
+				next = next == NULL ? end : next + 6;
+				jobs.submit(p, next, at + (p - base));
+				p = next;
+			}
+			if(!jobs.run())
+				return -1;
+			scanned += n;
+			//the jobs end out of file order
+			std::sort(ended.begin(), ended.end(), &splitter::earlier);
+			if(split and !split->add(ended))
+				return -1;
+			ended.clear();
+		}
+		if(stats)
+			jobs.printStats();
+	}else{
+		scanner scan(dfa, spamState, skipState, skipFrom);
+		scan.trace = true;
+		const char* block;
+		long n;
+		while((n = file.next(block)) > 0){
+			if(!scan.feed(block, block + n))
+				return -1;
+			if(split and !split->add(ended))
+				return -1;
+			ended.clear();
 		}
+		//output <end> when an error was taken trying to get input from file.
+		cout << "<end>" << endl;
+
+		//decide a message left open at the end of the file
+		scan.finish();
+		scanned = scan.doc.offset;
+		if(split and !split->add(ended))
+			return -1;
+	}
+	if(split){
+		if(!split->finish(scanned))
+			return -1;
+		if(stats)
+			split->printStats();
+	}
 
-	}while( input >= 0);
+	if(stats){
+		double elapsed = now() - began;
+		cerr << "scanned " << scanned << " bytes in " << elapsed << " s";
+		if(elapsed > 0)
+			cerr << " (" << scanned / elapsed / 1e6 << " MB/s)";
+		cerr << endl;
+	}
 
 	//report the spam message IDs
-	cout << "The following messages were spam:";
-	while(!(spamMessages.empty())){
-		cout << ' '<< spamMessages.front();
-		spamMessages.pop_front();
-	}
-	cout << endl;
+	reportSpam();
 
 	//exit successfully
 	return 0;